@@ -0,0 +1,893 @@
+// 6502-bench.c -- Throughput benchmark and cycle check for the CPU cores
+//
+// Build (CPU.c is pulled in through m4, like the dispatch table is):
+//
+//     m4 -P 6502-bench.c | cc -O2 -I. -x c - -o 6502-bench
+//
+// Add -DCPU_NO_COMPUTED_GOTO to time the portable `switch' builds of the
+// direct threaded and block cores instead of the labels-as-values ones,
+// and -DCPU_DECIMAL_MODE to time the generic 6502's ADC and SBC.
+//
+// Every opcode in 6502-instrs.tsv is run on its own under each core and
+// its cycle count checked against the TSV, which is read when the bench
+// starts (from the current directory, or BENCH_TSV), then timed in a
+// straight-line program; then the bus accesses stores and
+// read-modify-writes make to a register are counted, and after that
+// come the whole-program workloads. No ROM is needed, and the exit
+// status is non-zero if any count or final state is off, so the bench
+// doubles as a conformance check in CI.
+
+#include <time.h>
+
+m4_include(`CPU.c')m4_dnl
+
+#define BENCH_CYCLES 200000000ULL
+#define BENCH_ORIGIN 0x8000
+
+// A fixed workload: a loop over a 256-byte buffer mixing loads, stores,
+// ALU, shifts, RMW, a subroutine call and taken/not-taken branches.
+
+static const uint8_t BENCH_ROM[] = {
+  0xA2, 0xFF,       // $8000  LDX #$FF
+  0x9A,             // $8002  TXS
+  0xA0, 0x00,       // $8003  LDY #$00        outer
+  0xB9, 0x00, 0x02, // $8005  LDA $0200,Y     loop
+  0x18,             // $8008  CLC
+  0x69, 0x07,       // $8009  ADC #$07
+  0x99, 0x00, 0x02, // $800B  STA $0200,Y
+  0x45, 0x10,       // $800E  EOR $10
+  0x85, 0x10,       // $8010  STA $10
+  0x0A,             // $8012  ASL A
+  0x66, 0x11,       // $8013  ROR $11
+  0x20, 0x20, 0x80, // $8015  JSR $8020
+  0xC8,             // $8018  INY
+  0xD0, 0xEA,       // $8019  BNE $8005
+  0xE6, 0x12,       // $801B  INC $12
+  0x4C, 0x03, 0x80, // $801D  JMP $8003
+  0xB1, 0x20,       // $8020  LDA ($20),Y     sub
+  0xC9, 0x80,       // $8022  CMP #$80
+  0x90, 0x02,       // $8024  BCC $8028
+  0xE9, 0x40,       // $8026  SBC #$40
+  0xCA,             // $8028  DEX             skip
+  0x60,             // $8029  RTS
+};
+
+// A frame loop: a stretch of work, then PPUSTATUS polled until bit 7
+// comes up. The register below raises it every BENCH_FRAME_CYCLES and
+// clears it when read, and tells the block core how long it will read
+// the same, so that core can skip the wait.
+
+static const uint8_t BENCH_POLL_ROM[] = {
+  0xA2, 0x00,       // $8000  LDX #$00        frame
+  0xCA,             // $8002  DEX             work
+  0xD0, 0xFD,       // $8003  BNE $8002
+  0xE6, 0x12,       // $8005  INC $12
+  0xAD, 0x02, 0x20, // $8007  LDA $2002       wait
+  0x10, 0xFB,       // $800A  BPL $8007
+  0x4C, 0x00, 0x80, // $800C  JMP $8000
+};
+
+#define BENCH_FRAME_CYCLES 29781
+
+static uint64_t BENCH_FRAME_SEEN;
+
+static uint8_t
+bench_ppustatus_read (uint16_t addr)
+{
+  uint64_t frame = CPU.total_cycles / BENCH_FRAME_CYCLES;
+  uint8_t status = frame != BENCH_FRAME_SEEN ? 0x80 : 0x00;
+
+  (void)addr;
+  BENCH_FRAME_SEEN = frame;
+  return status;
+}
+
+static uint64_t
+bench_ppustatus_stable (uint16_t addr)
+{
+  (void)addr;
+  return (BENCH_FRAME_SEEN + 1) * BENCH_FRAME_CYCLES;
+}
+
+typedef struct
+{
+  const char *name;
+  const uint8_t *rom;
+  size_t size;
+  bool ppustatus;
+} bench_workload_t;
+
+static const bench_workload_t BENCH_WORKLOADS[] = {
+  { "mixed", BENCH_ROM, sizeof (BENCH_ROM), false },
+  { "poll", BENCH_POLL_ROM, sizeof (BENCH_POLL_ROM), true },
+};
+
+typedef void (*bench_core_fn_t) (uint64_t);
+
+static struct
+{
+  uint8_t ACC, XR, YR, SP;
+  uint16_t PC;
+  uint64_t total_cycles;
+  uint64_t total_instrs;
+  uint8_t contents[MEM_SIZE];
+} BENCH_RESULT;
+
+// The programs run on a flat 64 KiB of RAM in place of the console's
+// map, so that they can put code and data anywhere.
+
+static uint8_t BENCH_MEMORY[MEM_SIZE];
+
+static void
+bench_map_flat (void)
+{
+  memset (BENCH_MEMORY, 0, sizeof (BENCH_MEMORY));
+  cpu_mem_map (0x0000, 0xFFFF, BENCH_MEMORY, MEM_SIZE, true);
+}
+
+static void
+bench_load_rom (const bench_workload_t *w)
+{
+  bench_map_flat ();
+  memcpy (&BENCH_MEMORY[BENCH_ORIGIN], w->rom, w->size);
+  cpu_block_flush ();
+  cpu_mem_write_word (VECADDR_RESET, BENCH_ORIGIN);
+  cpu_mem_write_word (0x0020, 0x0200);
+  if (w->ppustatus)
+    {
+      cpu_mem_map_mmio (0x2000, 0x20FF, bench_ppustatus_read, NULL);
+      cpu_mem_map_stable (0x2000, 0x20FF, bench_ppustatus_stable);
+    }
+  BENCH_FRAME_SEEN = 0;
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_core (const bench_workload_t *w, const char *name,
+            bench_core_fn_t run)
+{
+  cpu_init ();
+  bench_load_rom (w);
+
+  double begin = bench_now ();
+  run (BENCH_CYCLES);
+  double elapsed = bench_now () - begin;
+  double ips = CPU.total_instrs / elapsed;
+
+  printf ("%-6s %-10s %12llu instrs %12llu cycles %8.3f s %10.2f Minstr/s\n",
+          w->name, name, (unsigned long long)CPU.total_instrs,
+          (unsigned long long)CPU.total_cycles, elapsed, ips / 1e6);
+  return ips;
+}
+
+static void
+bench_save_result (void)
+{
+  BENCH_RESULT.ACC = CPU.ACC;
+  BENCH_RESULT.XR = CPU.XR;
+  BENCH_RESULT.YR = CPU.YR;
+  BENCH_RESULT.SP = CPU.SP;
+  BENCH_RESULT.PC = CPU.PC;
+  BENCH_RESULT.total_cycles = CPU.total_cycles;
+  BENCH_RESULT.total_instrs = CPU.total_instrs;
+  memcpy (BENCH_RESULT.contents, BENCH_MEMORY, MEM_SIZE);
+}
+
+static bool
+bench_same_result (void)
+{
+  return BENCH_RESULT.ACC == CPU.ACC && BENCH_RESULT.XR == CPU.XR
+         && BENCH_RESULT.YR == CPU.YR && BENCH_RESULT.SP == CPU.SP
+         && BENCH_RESULT.PC == CPU.PC
+         && BENCH_RESULT.total_cycles == CPU.total_cycles
+         && BENCH_RESULT.total_instrs == CPU.total_instrs
+         && memcmp (BENCH_RESULT.contents, BENCH_MEMORY, MEM_SIZE) == 0;
+}
+
+static bool
+bench_workload (const bench_workload_t *w)
+{
+  double indirect = bench_core (w, "indirect", cpu_run_indirect);
+  bench_save_result ();
+
+#ifdef CPU_COMPUTED_GOTO
+  double direct = bench_core (w, "direct", cpu_run_direct);
+#else
+  double direct = bench_core (w, "switch", cpu_run_direct);
+#endif
+
+  if (!bench_same_result ())
+    return false;
+
+  double block = bench_core (w, "block", cpu_run_block);
+
+  if (!bench_same_result ())
+    return false;
+
+  cpu_idle_stats_t idle = cpu_idle_stats_take ();
+
+  printf ("%-6s speedup    %.2fx direct, %.2fx block, %llu idle loops "
+          "skipped for %.1f%% of cycles\n",
+          w->name, direct / indirect, block / indirect,
+          (unsigned long long)idle.loops,
+          100.0 * idle.cycles / CPU.total_cycles);
+  return true;
+}
+
+// Opcodes
+//
+// Each opcode the TSV describes is checked in every variant its cycle
+// column distinguishes: page crossed or not for the indexed modes, and
+// not taken, taken, or taken to another page for branches. A variant is
+// first run once, followed by a trap, and its cycles compared against
+// the TSV under each core; then BENCH_OP_COPIES copies of it run in a
+// loop to time it. Each copy falls through to the next: jumps and calls
+// target the following copy, returns find it on the stack, and branches
+// are taken with an offset of zero. BRK loops onto itself, and the branch
+// taken across a page is not timed, as it cannot be laid out that way.
+
+#define BENCH_OP_ORIGIN 0x8000
+#define BENCH_OP_CROSS_ORIGIN 0x80FD
+#define BENCH_OP_POINTERS 0x0400
+#define BENCH_OP_COPIES 64
+#define BENCH_OP_CYCLES 2000000ULL
+#define BENCH_OP_LIMIT 1000
+#define BENCH_OP_TRAP 0x02
+
+typedef enum
+{
+  BENCH_SAME_PAGE,
+  BENCH_PAGE_CROSS,
+  BENCH_NOT_TAKEN,
+  BENCH_TAKEN,
+  BENCH_TAKEN_CROSS,
+} bench_variant_t;
+
+static const char *const BENCH_VARIANT_NAMES[] = {
+  [BENCH_SAME_PAGE] = "",
+  [BENCH_PAGE_CROSS] = "page",
+  [BENCH_NOT_TAKEN] = "not taken",
+  [BENCH_TAKEN] = "taken",
+  [BENCH_TAKEN_CROSS] = "taken page",
+};
+
+static const struct
+{
+  resolver_fn_t resolver;
+  const char *name;
+} BENCH_MODES[] = {
+  { cpu_addrmode_impl, "implied" },     { cpu_addrmode_acc, "accumulator" },
+  { cpu_addrmode_imm, "immediate" },    { cpu_addrmode_zpg, "zeropage" },
+  { cpu_addrmode_zpgx, "zeropageX" },   { cpu_addrmode_zpgy, "zeropageY" },
+  { cpu_addrmode_abs, "absolute" },     { cpu_addrmode_absx, "absoluteX" },
+  { cpu_addrmode_absy, "absoluteY" },   { cpu_addrmode_ind, "indirect" },
+  { cpu_addrmode_xind, "indirectX" },   { cpu_addrmode_yind, "indirectY" },
+  { cpu_addrmode_rel, "relative" },
+};
+
+// The address-only resolvers stores and jumps are dispatched to, and
+// the mode each stands for
+static const struct
+{
+  resolver_fn_t address_only, resolver;
+} BENCH_ADDRESS_ONLY[] = {
+  { cpu_addrmode_zpg_ea, cpu_addrmode_zpg },
+  { cpu_addrmode_zpgx_ea, cpu_addrmode_zpgx },
+  { cpu_addrmode_zpgy_ea, cpu_addrmode_zpgy },
+  { cpu_addrmode_abs_ea, cpu_addrmode_abs },
+  { cpu_addrmode_absx_ea, cpu_addrmode_absx },
+  { cpu_addrmode_absy_ea, cpu_addrmode_absy },
+  { cpu_addrmode_xind_ea, cpu_addrmode_xind },
+  { cpu_addrmode_yind_ea, cpu_addrmode_yind },
+};
+
+// The status bit each branch tests, and whether it branches on it set
+static const struct
+{
+  itc_fn_t itc;
+  uint8_t bit;
+  bool taken_if_set;
+} BENCH_BRANCHES[] = {
+  { cpu_itc_bpl, STATUS_N, false }, { cpu_itc_bmi, STATUS_N, true },
+  { cpu_itc_bvc, STATUS_V, false }, { cpu_itc_bvs, STATUS_V, true },
+  { cpu_itc_bcc, STATUS_C, false }, { cpu_itc_bcs, STATUS_C, true },
+  { cpu_itc_bne, STATUS_Z, false }, { cpu_itc_beq, STATUS_Z, true },
+};
+
+static const struct
+{
+  const char *name;
+  bench_core_fn_t run;
+} BENCH_CORES[] = {
+  { "indirect", cpu_run_indirect },
+#ifdef CPU_COMPUTED_GOTO
+  { "direct", cpu_run_direct },
+#else
+  { "switch", cpu_run_direct },
+#endif
+  { "block", cpu_run_block },
+};
+
+#define BENCH_NUM_CORES (sizeof (BENCH_CORES) / sizeof (BENCH_CORES[0]))
+
+static resolver_fn_t
+bench_op_resolver (const dispatch_entry_t *entry)
+{
+  for (size_t i = 0;
+       i < sizeof (BENCH_ADDRESS_ONLY) / sizeof (BENCH_ADDRESS_ONLY[0]); i++)
+    if (BENCH_ADDRESS_ONLY[i].address_only == entry->resolver_fn)
+      return BENCH_ADDRESS_ONLY[i].resolver;
+  return entry->resolver_fn;
+}
+
+static const char *
+bench_op_mode (const dispatch_entry_t *entry)
+{
+  resolver_fn_t mode = bench_op_resolver (entry);
+
+  for (size_t i = 0; i < sizeof (BENCH_MODES) / sizeof (BENCH_MODES[0]); i++)
+    if (BENCH_MODES[i].resolver == mode)
+      return BENCH_MODES[i].name;
+  return "?";
+}
+
+static bool
+bench_op_is (const dispatch_entry_t *entry, const char *mnemonic)
+{
+  return strcmp (DISPATCH_INFO[entry->opcode].mnemonic, mnemonic) == 0;
+}
+
+static bool
+bench_op_uses_stack (const dispatch_entry_t *entry)
+{
+  return bench_op_is (entry, "JSR") || bench_op_is (entry, "RTS")
+         || bench_op_is (entry, "RTI") || bench_op_is (entry, "PHA")
+         || bench_op_is (entry, "PHP") || bench_op_is (entry, "PLA")
+         || bench_op_is (entry, "PLP");
+}
+
+static size_t
+bench_op_variants (const dispatch_entry_t *entry, bench_variant_t *out)
+{
+  resolver_fn_t mode = bench_op_resolver (entry);
+  size_t n = 0;
+
+  if (mode == cpu_addrmode_rel)
+    {
+      out[n++] = BENCH_NOT_TAKEN;
+      out[n++] = BENCH_TAKEN;
+      out[n++] = BENCH_TAKEN_CROSS;
+    }
+  else
+    {
+      out[n++] = BENCH_SAME_PAGE;
+      if (mode == cpu_addrmode_absx || mode == cpu_addrmode_absy
+          || mode == cpu_addrmode_yind)
+        out[n++] = BENCH_PAGE_CROSS;
+    }
+  return n;
+}
+
+// Expected Cycles
+//
+// Taken from 6502-instrs.tsv itself, not from the dispatch table the
+// awk script generates from it, so that a slip in the generator shows
+// up as a mismatch instead of being checked against itself. A count
+// marked `*' takes a cycle more when indexing crosses a page, and `**'
+// (branches) one more when taken and another when that crosses a page.
+
+#ifndef BENCH_TSV
+#define BENCH_TSV "6502-instrs.tsv"
+#endif
+
+#define BENCH_TSV_FIELDS 6
+
+typedef struct
+{
+  bool listed;
+  unsigned cycles;
+  special_case_t special_case;
+} bench_tsv_entry_t;
+
+static bench_tsv_entry_t BENCH_TSV_ENTRIES[UCHAR_MAX + 1];
+
+static bool
+bench_tsv_load (void)
+{
+  FILE *f = fopen (BENCH_TSV, "r");
+  char line[256];
+
+  if (f == NULL)
+    {
+      perror (BENCH_TSV);
+      return false;
+    }
+
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      char *field[BENCH_TSV_FIELDS];
+      char *marks;
+      int n = 0;
+
+      for (char *tok = strtok (line, "\t\n");
+           tok != NULL && n < BENCH_TSV_FIELDS; tok = strtok (NULL, "\t\n"))
+        field[n++] = tok;
+      if (n < BENCH_TSV_FIELDS)
+        continue;
+
+      bench_tsv_entry_t *e = &BENCH_TSV_ENTRIES[strtoul (field[3], NULL, 16)
+                                                & MASK_BYTE];
+      e->listed = true;
+      e->cycles = strtoul (field[5], &marks, 10);
+      if (strncmp (marks, "**", 2) == 0)
+        e->special_case = SPECIALCASE_BRANCH_CROSS;
+      else if (*marks == '*')
+        e->special_case = SPECIALCASE_PAGE_CROSS;
+      else
+        e->special_case = SPECIALCASE_NONE;
+    }
+
+  fclose (f);
+  return true;
+}
+
+static unsigned
+bench_op_expected (const dispatch_entry_t *entry, bench_variant_t variant)
+{
+  const bench_tsv_entry_t *e = &BENCH_TSV_ENTRIES[entry->opcode];
+  unsigned cycles = e->cycles;
+
+  if (variant == BENCH_PAGE_CROSS
+      && e->special_case == SPECIALCASE_PAGE_CROSS)
+    cycles += 1;
+  else if (variant == BENCH_TAKEN
+           && e->special_case == SPECIALCASE_BRANCH_CROSS)
+    cycles += 1;
+  else if (variant == BENCH_TAKEN_CROSS
+           && e->special_case == SPECIALCASE_BRANCH_CROSS)
+    cycles += 2;
+  return cycles;
+}
+
+// Copy K of the program at AT, continuing at NEXT: an operand that
+// reaches the data at $0200 (or, crossing, $02F0 + $20 into the next
+// page), plus whatever pointer or stack entry gets it to NEXT.
+
+static void
+bench_op_emit (const dispatch_entry_t *entry, bench_variant_t variant,
+               unsigned k, uint16_t at, uint16_t next)
+{
+  resolver_fn_t mode = bench_op_resolver (entry);
+  bool cross = variant == BENCH_PAGE_CROSS;
+  uint16_t operand = 0;
+
+  if (mode == cpu_addrmode_imm)
+    operand = 0x01;
+  else if (mode == cpu_addrmode_zpg || mode == cpu_addrmode_xind)
+    operand = 0x40;
+  else if (mode == cpu_addrmode_zpgx || mode == cpu_addrmode_zpgy)
+    operand = 0x10;
+  else if (mode == cpu_addrmode_abs)
+    operand = bench_op_is (entry, "JMP") || bench_op_is (entry, "JSR")
+                  ? next
+                  : 0x0240;
+  else if (mode == cpu_addrmode_absx || mode == cpu_addrmode_absy)
+    operand = cross ? 0x02F0 : 0x0200;
+  else if (mode == cpu_addrmode_yind)
+    operand = cross ? 0x44 : 0x42;
+  else if (mode == cpu_addrmode_ind)
+    {
+      operand = BENCH_OP_POINTERS + 2 * k;
+      cpu_mem_write_word (operand, next);
+    }
+  else if (mode == cpu_addrmode_rel)
+    operand = variant == BENCH_TAKEN_CROSS ? 1 : 0;
+
+  if (bench_op_is (entry, "RTS"))
+    cpu_mem_write_word (0x0100 + 2 * k, next - 1);
+  else if (bench_op_is (entry, "RTI"))
+    {
+      cpu_mem_write_byte (0x0100 + 3 * k, STATUS_X | STATUS_I);
+      cpu_mem_write_word (0x0100 + 3 * k + 1, next);
+    }
+  else if (bench_op_is (entry, "BRK"))
+    cpu_mem_write_word (VECADDR_IRQ, next);
+
+  cpu_mem_write_byte (at, entry->opcode);
+  if (entry->size_bytes >= 2)
+    cpu_mem_write_byte (at + 1, operand & MASK_BYTE);
+  if (entry->size_bytes == 3)
+    cpu_mem_write_byte (at + 2, operand >> 8);
+}
+
+// Lays out COPIES copies of the variant and puts the machine in front
+// of them, followed either by a trap or, with LOOP, by a jump back (and
+// first a stack reset for the opcodes that move it).
+
+static void
+bench_op_load (const dispatch_entry_t *entry, bench_variant_t variant,
+               unsigned copies, bool loop)
+{
+  uint16_t origin = variant == BENCH_TAKEN_CROSS ? BENCH_OP_CROSS_ORIGIN
+                                                 : BENCH_OP_ORIGIN;
+  uint16_t at = origin;
+  uint8_t status = STATUS_X | STATUS_I;
+
+  cpu_init ();
+  CPU.pending_RESET = false;
+  bench_map_flat ();
+  cpu_mem_write_word (0x0042, 0x0200);
+  cpu_mem_write_word (0x0044, 0x02F0);
+  cpu_mem_write_word (0x0060, 0x0240);
+
+  for (unsigned k = 0; k < copies; k++)
+    {
+      uint16_t next = at + entry->size_bytes;
+
+      if (variant == BENCH_TAKEN_CROSS)
+        next++;
+      if (loop && bench_op_is (entry, "BRK"))
+        next = origin;
+      bench_op_emit (entry, variant, k, at, next);
+      at = next;
+    }
+
+  if (!loop)
+    cpu_mem_write_byte (at, BENCH_OP_TRAP);
+  else if (at != origin)
+    {
+      static const uint8_t reset_stack[] = { 0xA2, 0xFF, 0x9A };
+
+      if (bench_op_uses_stack (entry))
+        for (size_t i = 0; i < sizeof (reset_stack); i++)
+          cpu_mem_write_byte (at++, reset_stack[i]);
+      cpu_mem_write_byte (at, 0x4C);
+      cpu_mem_write_word (at + 1, origin);
+    }
+
+  for (size_t i = 0; i < sizeof (BENCH_BRANCHES) / sizeof (BENCH_BRANCHES[0]);
+       i++)
+    if (BENCH_BRANCHES[i].itc == entry->itc_fn)
+      {
+        bool taken = variant != BENCH_NOT_TAKEN;
+        if (taken == BENCH_BRANCHES[i].taken_if_set)
+          status |= BENCH_BRANCHES[i].bit;
+      }
+
+  cpu_flag_unpack (status);
+  cpu_block_flush ();
+  CPU.XR = 0x20;
+  CPU.YR = 0x20;
+  CPU.SP = 0xFF;
+  CPU.PC = origin;
+}
+
+// Checks one variant under every core and times it; returns false if
+// any core's count is off, or its loop stopped.
+
+static bool
+bench_op_variant (const dispatch_entry_t *entry, bench_variant_t variant,
+                  double *ns)
+{
+  unsigned expected = bench_op_expected (entry, variant);
+  uint64_t cycles[BENCH_NUM_CORES];
+  bool ok = true;
+
+  for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+    {
+      bench_op_load (entry, variant, 1, false);
+      BENCH_CORES[c].run (BENCH_OP_LIMIT);
+      cycles[c] = CPU.total_cycles - DISPATCH_TABLE[BENCH_OP_TRAP].num_cycles;
+      if (cycles[c] != expected || CPU.total_instrs != 2 || CPU.running)
+        ok = false;
+    }
+
+  printf ("$%02X %-3s %-11s %-10s %u", entry->opcode,
+          DISPATCH_INFO[entry->opcode].mnemonic, bench_op_mode (entry),
+          BENCH_VARIANT_NAMES[variant], expected);
+
+  for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+    {
+      if (variant == BENCH_TAKEN_CROSS)
+        {
+          ns[c] = 0;
+          printf (" %8s", "-");
+          continue;
+        }
+
+      unsigned copies = bench_op_is (entry, "BRK") ? 1 : BENCH_OP_COPIES;
+
+      bench_op_load (entry, variant, copies, true);
+      double begin = bench_now ();
+      BENCH_CORES[c].run (BENCH_OP_CYCLES);
+      ns[c] = (bench_now () - begin) / CPU.total_instrs * 1e9;
+      ok = ok && CPU.running;
+      printf (" %8.2f", ns[c]);
+    }
+
+  if (ok)
+    printf ("  ok\n");
+  else
+    {
+      printf ("  MISMATCH");
+      for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+        printf (" %s=%llu", BENCH_CORES[c].name,
+                (unsigned long long)cycles[c]);
+      printf ("\n");
+    }
+  return ok;
+}
+
+static bool
+bench_opcodes (void)
+{
+  double total[BENCH_NUM_CORES] = { 0 };
+  unsigned timed = 0, checked = 0, failed = 0;
+
+  printf ("%-3s %-3s %-11s %-10s %s", "op", "", "mode", "variant", "cyc");
+  for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+    printf (" %8s", BENCH_CORES[c].name);
+  printf ("  (ns/instr)\n");
+
+  for (unsigned op = 0; op <= UCHAR_MAX; op++)
+    {
+      const dispatch_entry_t *entry = &DISPATCH_TABLE[op];
+      bench_variant_t variants[3];
+      size_t n;
+
+      // The TSV and the dispatch table must agree on what is an opcode
+      if (BENCH_TSV_ENTRIES[op].listed != (entry->itc_fn != cpu_itc_trap))
+        {
+          printf ("$%02X %s  MISMATCH\n", op,
+                  BENCH_TSV_ENTRIES[op].listed ? "listed in the TSV, traps"
+                                               : "not in the TSV, dispatched");
+          checked++;
+          failed++;
+          continue;
+        }
+      if (entry->itc_fn == cpu_itc_trap)
+        continue;
+
+      n = bench_op_variants (entry, variants);
+      for (size_t v = 0; v < n; v++)
+        {
+          double ns[BENCH_NUM_CORES];
+
+          checked++;
+          if (!bench_op_variant (entry, variants[v], ns))
+            failed++;
+          if (variants[v] == BENCH_TAKEN_CROSS)
+            continue;
+          timed++;
+          for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+            total[c] += ns[c];
+        }
+    }
+
+  printf ("%u variants checked, %u failed; mean ns/instr", checked,
+          failed);
+  for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+    printf (" %s %.2f", BENCH_CORES[c].name, total[c] / timed);
+  printf ("\n\n");
+  return failed == 0;
+}
+
+// Bus Accesses
+//
+// A register can act on being read as well as on being written: a read
+// of PPUDATA moves its address on just as a write does. So each case
+// below runs one instruction on a register page under every core and
+// counts what reaches it. Stores write once and read nothing; a
+// read-modify-write reads once and writes twice, the unmodified value
+// and then the result.
+
+#define BENCH_BUS_PAGE 0x2000
+
+typedef struct
+{
+  const char *name;
+  uint8_t code[3];
+  unsigned reads, writes;
+} bench_bus_case_t;
+
+static const bench_bus_case_t BENCH_BUS_CASES[] = {
+  { "STA $2007", { 0x8D, 0x07, 0x20 }, 0, 1 },
+  { "STX $2007", { 0x8E, 0x07, 0x20 }, 0, 1 },
+  { "STY $2007", { 0x8C, 0x07, 0x20 }, 0, 1 },
+  { "STA $1FE7,X", { 0x9D, 0xE7, 0x1F }, 0, 1 },
+  { "STA ($42),Y", { 0x91, 0x42 }, 0, 1 },
+  { "INC $2007", { 0xEE, 0x07, 0x20 }, 1, 2 },
+  { "ASL $2007", { 0x0E, 0x07, 0x20 }, 1, 2 },
+  { "LDA $2007", { 0xAD, 0x07, 0x20 }, 1, 0 },
+};
+
+static unsigned BENCH_BUS_READS, BENCH_BUS_WRITES;
+static bool BENCH_BUS_END;
+
+static uint8_t
+bench_bus_read (uint16_t addr)
+{
+  (void)addr;
+  BENCH_BUS_READS++;
+  return 0x00;
+}
+
+static void
+bench_bus_write (uint16_t addr, uint8_t val)
+{
+  (void)addr;
+  (void)val;
+  BENCH_BUS_WRITES++;
+  if (BENCH_BUS_END)
+    cpu_run_end ();
+}
+
+static bool
+bench_bus (void)
+{
+  unsigned failed = 0;
+
+  for (size_t i = 0; i < sizeof (BENCH_BUS_CASES) / sizeof (BENCH_BUS_CASES[0]);
+       i++)
+    {
+      const bench_bus_case_t *bc = &BENCH_BUS_CASES[i];
+      bool ok = true;
+
+      printf ("%-12s %u reads %u writes", bc->name, bc->reads, bc->writes);
+      for (size_t c = 0; c < BENCH_NUM_CORES; c++)
+        {
+          cpu_init ();
+          CPU.pending_RESET = false;
+          bench_map_flat ();
+          cpu_mem_map_mmio (BENCH_BUS_PAGE, BENCH_BUS_PAGE + 0xFF,
+                            bench_bus_read, bench_bus_write);
+          memcpy (&BENCH_MEMORY[BENCH_OP_ORIGIN], bc->code,
+                  sizeof (bc->code));
+          BENCH_MEMORY[BENCH_OP_ORIGIN + DISPATCH_TABLE[bc->code[0]].size_bytes]
+              = BENCH_OP_TRAP;
+          cpu_mem_write_word (0x0042, BENCH_BUS_PAGE);
+          cpu_block_flush ();
+          CPU.XR = 0x20;
+          CPU.YR = 0x07;
+          CPU.PC = BENCH_OP_ORIGIN;
+          BENCH_BUS_READS = BENCH_BUS_WRITES = 0;
+
+          BENCH_CORES[c].run (BENCH_OP_LIMIT);
+          if (BENCH_BUS_READS != bc->reads || BENCH_BUS_WRITES != bc->writes
+              || CPU.total_instrs != 2)
+            {
+              printf ("  MISMATCH %s=%u/%u", BENCH_CORES[c].name,
+                      BENCH_BUS_READS, BENCH_BUS_WRITES);
+              ok = false;
+            }
+        }
+      printf (ok ? "  ok\n" : "\n");
+      failed += !ok;
+    }
+
+  printf ("%zu bus cases checked, %u failed\n\n",
+          sizeof (BENCH_BUS_CASES) / sizeof (BENCH_BUS_CASES[0]), failed);
+  return failed == 0;
+}
+
+// A register handler calling cpu_run_end stops the run after the
+// instruction making the access, in the middle of a block too, and
+// cpu_run leaves the CPU ready to run on.
+
+static bool
+bench_run_end (void)
+{
+  static const uint8_t CODE[] = {
+    0xEA,             // NOP
+    0x8D, 0x07, 0x20, // STA $2007
+    0xEA,             // NOP
+    0xEA,             // NOP
+    0x4C, BENCH_OP_ORIGIN & MASK_BYTE, BENCH_OP_ORIGIN >> 8,
+  };
+  bool ok = true;
+
+  printf ("%-12s", "run end");
+  for (size_t c = 0; c <= BENCH_NUM_CORES; c++)
+    {
+      cpu_init ();
+      CPU.pending_RESET = false;
+      bench_map_flat ();
+      cpu_mem_map_mmio (BENCH_BUS_PAGE, BENCH_BUS_PAGE + 0xFF, bench_bus_read,
+                        bench_bus_write);
+      memcpy (&BENCH_MEMORY[BENCH_OP_ORIGIN], CODE, sizeof (CODE));
+      cpu_block_flush ();
+      CPU.PC = BENCH_OP_ORIGIN;
+      BENCH_BUS_END = true;
+
+      // The last pass goes through cpu_run
+      const char *name = c < BENCH_NUM_CORES ? BENCH_CORES[c].name : "run";
+      if (c < BENCH_NUM_CORES)
+        BENCH_CORES[c].run (BENCH_OP_LIMIT);
+      else
+        cpu_run (BENCH_OP_LIMIT);
+      bool running = c == BENCH_NUM_CORES;
+
+      if (CPU.total_instrs != 2 || CPU.running != running)
+        {
+          printf ("  MISMATCH %s=%llu instrs", name,
+                  (unsigned long long)CPU.total_instrs);
+          ok = false;
+        }
+    }
+  BENCH_BUS_END = false;
+  printf (ok ? "  stops after STA  ok\n\n" : "\n\n");
+  return ok;
+}
+
+// Two contexts, each selected, reset and run in turn, keep their own
+// count, and the default context is left untouched: nothing about the
+// context may be carried over a select.
+
+static bool
+bench_contexts (void)
+{
+  static const uint64_t LIMITS[2] = { 1000, 5000 };
+  cpu_context_t *ctx[2] = { cpu_context_new (), cpu_context_new () };
+  cpu_context_t *home = cpu_context_current ();
+  uint64_t cycles[2];
+  bool ok = ctx[0] != NULL && ctx[1] != NULL;
+
+  for (int i = 0; ok && i < 2; i++)
+    {
+      cpu_context_select (ctx[i]);
+      cpu_init ();
+      bench_map_flat ();
+      memset (&BENCH_MEMORY[BENCH_OP_ORIGIN], 0xEA, 0x4000); // NOP
+      CPU.pending_RESET = false;
+      CPU.PC = BENCH_OP_ORIGIN;
+      cpu_run (LIMITS[i]);
+    }
+  for (int i = 0; ok && i < 2; i++)
+    {
+      cpu_context_select (ctx[i]);
+      cycles[i] = CPU.total_cycles;
+      ok = cycles[i] == LIMITS[i];
+    }
+  cpu_context_select (home);
+
+  printf ("%-12s", "contexts");
+  if (ok)
+    printf ("  ran %llu and %llu cycles  ok\n\n",
+            (unsigned long long)cycles[0], (unsigned long long)cycles[1]);
+  else
+    printf ("  MISMATCH\n\n");
+  cpu_context_free (ctx[0]);
+  cpu_context_free (ctx[1]);
+  return ok;
+}
+
+int
+main (void)
+{
+  if (!bench_tsv_load ())
+    return EXIT_FAILURE;
+
+  bool conforms = bench_opcodes ();
+
+  conforms = bench_bus () && conforms;
+  conforms = bench_run_end () && conforms;
+  conforms = bench_contexts () && conforms;
+
+  for (size_t i = 0; i < sizeof (BENCH_WORKLOADS) / sizeof (BENCH_WORKLOADS[0]);
+       i++)
+    if (!bench_workload (&BENCH_WORKLOADS[i]))
+      {
+        fprintf (stderr, "%s: cores disagree on the final machine state\n",
+                 BENCH_WORKLOADS[i].name);
+        return EXIT_FAILURE;
+      }
+
+  return conforms ? EXIT_SUCCESS : EXIT_FAILURE;
+}
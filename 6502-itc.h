@@ -2,21 +2,21 @@ static void
 cpu_itc_lda (void)
 {
   CPU.ACC = OPERAND.byte & MASK_BYTE;
-  cpu_flag_toggle_zn (CPU.ACC);
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
 cpu_itc_ldx (void)
 {
   CPU.XR = OPERAND.byte & MASK_BYTE;
-  cpu_flag_toggle_zn (CPU.XR);
+  cpu_flag_set_nz (CPU.XR);
 }
 
 static void
 cpu_itc_ldy (void)
 {
   CPU.YR = OPERAND.byte & MASK_BYTE;
-  cpu_flag_toggle_zn (CPU.YR);
+  cpu_flag_set_nz (CPU.YR);
 }
 
 static void
@@ -41,147 +41,138 @@ static void
 cpu_itc_and (void)
 {
   CPU.ACC &= OPERAND.byte & MASK_BYTE;
-  cpu_flag_toggle_zn (CPU.ACC);
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
 cpu_itc_ora (void)
 {
   CPU.ACC |= OPERAND.byte & MASK_BYTE;
-  cpu_flag_toggle_zn (CPU.ACC);
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
 cpu_itc_eor (void)
 {
   CPU.ACC ^= OPERAND.byte & MASK_BYTE;
-  cpu_flag_toggle_zn (CPU.ACC);
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
 cpu_itc_adc (void)
 {
-  cpu_flag_is_set ('D') && cpu_helper_adc_decimal (OPERAND.byte)
-      || cpu_helper_adc_binary (OPERAND.byte);
+#ifdef CPU_DECIMAL_MODE
+  if (FLAGS.D)
+    {
+      cpu_helper_adc_decimal (OPERAND.byte);
+      return;
+    }
+#endif
+  cpu_helper_adc_binary (OPERAND.byte);
 }
 
 static void
 cpu_itc_sbc (void)
 {
-  cpu_flag_is_set ('D') && cpu_helper_sbc_decimal (OPERAND.byte)
-      || cpu_helper_sbc_binary (OPERAND.byte);
+#ifdef CPU_DECIMAL_MODE
+  if (FLAGS.D)
+    {
+      cpu_helper_sbc_decimal (OPERAND.byte);
+      return;
+    }
+#endif
+  cpu_helper_sbc_binary (OPERAND.byte);
 }
 
 static void
 cpu_itc_asl (void)
 {
-  cpu_flag_set_if ('C', (OPERAND.byte & MASK_COMPLEMENT) != 0);
+  FLAGS.C = (OPERAND.byte & MASK_COMPLEMENT) != 0;
   uint8_t written = cpu_helper_rmw (cpu_rmwutil_asl);
-  cpu_flag_set_zn (written);
+  cpu_flag_set_nz (written);
 }
 
 static void
 cpu_itc_lsr (void)
 {
-  cpu_flag_set_if ('C', (OPERAND.byte & MASK_LSR) != 0);
-  uint8_t written = cpu_helper_rmw (cpu_rwmutil_lsr);
-  cpu_flag_set_zn (written);
+  FLAGS.C = (OPERAND.byte & MASK_LSR) != 0;
+  uint8_t written = cpu_helper_rmw (cpu_rmwutil_lsr);
+  cpu_flag_set_nz (written);
 }
 
 static void
 cpu_itc_rol (void)
 {
-  cpu_flag_set_if ('C', (OPERAND.byte & MASK_COMPLEMENT) != 0);
   uint8_t written = cpu_helper_rmw (cpu_rmwutil_rol);
-  cpu_flag_toggle_zn (written);
+  FLAGS.C = (OPERAND.byte & MASK_COMPLEMENT) != 0;
+  cpu_flag_set_nz (written);
 }
 
 static void
 cpu_itc_ror (void)
 {
-  cpu_flag_set_if ('C', (OPERAND.byte & MASK_LSR) != 0);
   uint8_t written = cpu_helper_rmw (cpu_rmwutil_ror);
-  cpu_flag_toggle_zn (written);
+  FLAGS.C = (OPERAND.byte & MASK_LSR) != 0;
+  cpu_flag_set_nz (written);
 }
 
 static void
 cpu_itc_inc (void)
 {
-  uint8_t increased = (cpu_mem_read_byte (OPERAND.word) + 1) & MASK_BYTE;
-  cpu_mem_write_byte (OPERAND.word, increased);
-  cpu_flag_toggle_zn (increased);
+  uint8_t increased = (OPERAND.byte + 1) & MASK_BYTE;
+  cpu_mem_write_rmw (OPERAND.word, OPERAND.byte, increased);
+  cpu_flag_set_nz (increased);
 }
 
 static void
 cpu_itc_dec (void)
 {
-  uint8_t decreased = (cpu_mem_read_byte (OPERAND.word) - 1) & MASK_BYTE;
-  cpu_mem_write_byte (OPERAND.word, decreased);
-  cpu_flag_toggle_zn (decreased);
+  uint8_t decreased = (OPERAND.byte - 1) & MASK_BYTE;
+  cpu_mem_write_rmw (OPERAND.word, OPERAND.byte, decreased);
+  cpu_flag_set_nz (decreased);
 }
 
 static void
 cpu_itc_bit (void)
 {
-  cpu_flag_set_if ('Z', ((CPU.ACC & OPERAND.byte) & MASK_BYTE) == 0);
-  cpu_flag_set_if ('N', (OPERAND.byte & MASK_COMPLEMENT) != 0);
-  cpu_flag_set_if ('V', (OPERAND.byte & MASK_BIT) != 0);
+  cpu_flag_set_nz_bits ((OPERAND.byte & MASK_COMPLEMENT) != 0,
+                        ((CPU.ACC & OPERAND.byte) & MASK_BYTE) == 0);
+  FLAGS.V = (OPERAND.byte & MASK_BIT) != 0;
 }
 
 static void
 cpu_itc_tax (void)
 {
   CPU.XR = CPU.ACC;
-  cpu_flag_toggle_zn (C.XR);
-}
-
-static void
-cpu_itc_tax (void)
-{
-  CPU.XR = CPU.ACC;
-  cpu_flag_toggle_zn (C.XR);
-}
-
-static void
-cpu_itc_tax (void)
-{
-  CPU.XR = CPU.ACC;
-  cpu_flag_toggle_zn (C.XR);
-}
-
-static void
-cpu_itc_tax (void)
-{
-  CPU.XR = CPU.ACC;
-  cpu_flag_toggle_zn (C.XR);
+  cpu_flag_set_nz (CPU.XR);
 }
 
 static void
 cpu_itc_txa (void)
 {
   CPU.ACC = CPU.XR;
-  cpu_flag_toggle_zn (C.ACC);
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
 cpu_itc_tay (void)
 {
   CPU.YR = CPU.ACC;
-  cpu_flag_toggle_zn (C.YR);
+  cpu_flag_set_nz (CPU.YR);
 }
 
 static void
 cpu_itc_tya (void)
 {
   CPU.ACC = CPU.YR;
-  cpu_flag_toggle_zn (C.ACC);
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
 cpu_itc_tsx (void)
 {
   CPU.XR = CPU.SP;
-  cpu_flag_toggle_zn (C.XR);
+  cpu_flag_set_nz (CPU.XR);
 }
 
 static void
@@ -194,35 +185,28 @@ static void
 cpu_itc_inx (void)
 {
   CPU.XR++;
-  cpu_flag_toggle_zn (C.XR);
-}
-
-static void
-cpu_itc_inx (void)
-{
-  CPU.XR++;
-  cpu_flag_toggle_zn (C.XR);
+  cpu_flag_set_nz (CPU.XR);
 }
 
 static void
 cpu_itc_iny (void)
 {
   CPU.YR++;
-  cpu_flag_toggle_zn (C.YR);
+  cpu_flag_set_nz (CPU.YR);
 }
 
 static void
 cpu_itc_dex (void)
 {
   CPU.XR--;
-  cpu_flag_toggle_zn (C.XR);
+  cpu_flag_set_nz (CPU.XR);
 }
 
 static void
 cpu_itc_dey (void)
 {
   CPU.YR--;
-  cpu_flag_toggle_zn (C.YR);
+  cpu_flag_set_nz (CPU.YR);
 }
 
 static void
@@ -246,43 +230,43 @@ cpu_itc_cpy (void)
 static void
 cpu_itc_clc (void)
 {
-  cpu_flag_unset ('C');
+  FLAGS.C = 0;
 }
 
 static void
 cpu_itc_sec (void)
 {
-  cpu_flag_set ('C');
+  FLAGS.C = 1;
 }
 
 static void
 cpu_itc_cld (void)
 {
-  cpu_flag_unset ('D');
+  FLAGS.D = 0;
 }
 
 static void
 cpu_itc_sed (void)
 {
-  cpu_flag_set ('D');
+  FLAGS.D = 1;
 }
 
 static void
 cpu_itc_cli (void)
 {
-  cpu_flag_unset ('I');
+  FLAGS.I = 0;
 }
 
 static void
 cpu_itc_sei (void)
 {
-  cpu_flag_set ('I');
+  FLAGS.I = 1;
 }
 
 static void
 cpu_itc_clv (void)
 {
-  cpu_flag_unset ('V');
+  FLAGS.V = 0;
 }
 
 static void
@@ -301,6 +285,7 @@ static void
 cpu_itc_pla (void)
 {
   cpu_status_restore_acc ();
+  cpu_flag_set_nz (CPU.ACC);
 }
 
 static void
@@ -318,8 +303,8 @@ cpu_itc_plp (void)
 static void
 cpu_itc_jsr (void)
 {
-  uint8_t ret = (CPU.PC - 1) & MASK_SHORT;
-  cpu_stack_push_short (ret);
+  uint16_t ret = (CPU.PC - 1) & MASK_WORD;
+  cpu_stack_push_word (ret);
   CPU.PC = OPERAND.word;
 }
 
@@ -327,6 +312,7 @@ static void
 cpu_itc_rts (void)
 {
   cpu_status_restore_pc ();
+  CPU.PC += 1;
 }
 
 static void
@@ -339,63 +325,69 @@ cpu_itc_rti (void)
 static void
 cpu_itc_brk (void)
 {
-  CPU.PC += 2;
+  CPU.PC += 1;
   cpu_status_save_pc ();
   cpu_status_save_modified_flags ();
-  cpu_flag_set ('I');
-  CPU.PC = cpu_mem_write_short (VECADDR_IRQ);
+  FLAGS.I = 1;
+  CPU.PC = cpu_mem_read_word (VECADDR_IRQ);
 }
 
 static void
 cpu_itc_jmp (void)
 {
-  CPU.PC = OPERAND.word & MASK_SHORT;
+  CPU.PC = OPERAND.word & MASK_WORD;
 }
 
 static void
 cpu_itc_bpl (void)
 {
-  cpu_helper_branch (cpu_flag_is_unset ('N'));
+  cpu_helper_branch (!cpu_flag_n ());
 }
 
 static void
 cpu_itc_bmi (void)
 {
-  cpu_helper_branch (cpu_flag_is_set ('N'));
+  cpu_helper_branch (cpu_flag_n ());
 }
 
 static void
 cpu_itc_bvc (void)
 {
-  cpu_helper_branch (cpu_flag_is_unset ('V'));
+  cpu_helper_branch (!FLAGS.V);
 }
 
 static void
 cpu_itc_bvs (void)
 {
-  cpu_helper_branch (cpu_flag_is_set ('V'));
+  cpu_helper_branch (FLAGS.V);
 }
 
 static void
 cpu_itc_bcc (void)
 {
-  cpu_helper_branch (cpu_flag_is_unset ('C'));
+  cpu_helper_branch (!FLAGS.C);
 }
 
 static void
 cpu_itc_bcs (void)
 {
-  cpu_helper_branch (cpu_flag_is_set ('C'));
+  cpu_helper_branch (FLAGS.C);
 }
 
 static void
 cpu_itc_bne (void)
 {
-  cpu_helper_branch (cpu_flag_is_unset ('Z'));
+  cpu_helper_branch (!cpu_flag_z ());
 }
 
 static void
 cpu_itc_beq (void)
 {
-  cpu_helper_branch (cpu_flag_is_set ('Z'));
+  cpu_helper_branch (cpu_flag_z ());
+}
+
+static void
+cpu_itc_trap (void)
+{
+  CPU.running = false;
 }
@@ -0,0 +1,248 @@
+// 6502-profile.c -- Turns a CPU_PROFILE dump into flame graph input
+//
+// Build (CPU.c is pulled in through m4 for the opcode names):
+//
+//     m4 -P 6502-profile.c | cc -O2 -I. -x c - -o 6502-profile
+//
+// Usage:
+//
+//     6502-profile DUMP [LABELS]      folded stacks, one line per PC
+//     6502-profile -s DUMP            cycles and penalties per opcode
+//
+// Each folded line reads `region;label;$PC cycles', where the region is
+// `bus' for PCs counted by address and `prg:NN' (8 KiB bank NN) for PCs
+// counted by ROM offset, so flamegraph.pl or speedscope show the banks
+// side by side. LABELS is an ld65 -Ln file (`al 00C000 .name'); a PC
+// takes the nearest label at or below its address, `?' if none.
+
+#define CPU_PROFILE
+
+m4_include(`CPU.c')m4_dnl
+
+#define PROF_BANK_SHIFT 13
+#define PROF_LABEL_LEN 64
+
+typedef struct
+{
+  uint32_t slot;
+  uint16_t addr;
+  uint64_t cycles;
+} prof_pc_t;
+
+typedef struct
+{
+  uint16_t addr;
+  char name[PROF_LABEL_LEN];
+} prof_label_t;
+
+static cpu_profile_op_t PROF_OPS[UCHAR_MAX + 1];
+static prof_pc_t *PROF_PCS;
+static uint32_t PROF_NUM_PCS;
+static prof_label_t *PROF_LABELS;
+static size_t PROF_NUM_LABELS;
+
+static bool
+prof_get (FILE *f, uint64_t *val, int bytes)
+{
+  *val = 0;
+  for (int i = 0; i < bytes; i++)
+    {
+      int c = getc (f);
+      if (c == EOF)
+        return false;
+      *val |= (uint64_t)c << (8 * i);
+    }
+  return true;
+}
+
+static bool
+prof_load_dump (const char *path)
+{
+  char magic[sizeof (PROFILE_MAGIC)] = { 0 };
+  uint64_t rom_size, count, val;
+  FILE *f = fopen (path, "rb");
+
+  if (f == NULL)
+    return false;
+
+  if (fread (magic, 1, strlen (PROFILE_MAGIC), f) != strlen (PROFILE_MAGIC)
+      || strcmp (magic, PROFILE_MAGIC) != 0 || !prof_get (f, &rom_size, 4)
+      || !prof_get (f, &count, 4))
+    goto fail;
+
+  for (int i = 0; i <= UCHAR_MAX; i++)
+    {
+      cpu_profile_op_t *op = &PROF_OPS[i];
+
+      if (!prof_get (f, &op->instrs, 8) || !prof_get (f, &op->cycles, 8)
+          || !prof_get (f, &op->page_cross, 8)
+          || !prof_get (f, &op->branch_taken, 8)
+          || !prof_get (f, &op->branch_cross, 8))
+        goto fail;
+    }
+
+  PROF_PCS = calloc (count, sizeof (*PROF_PCS));
+  if (count != 0 && PROF_PCS == NULL)
+    goto fail;
+
+  for (PROF_NUM_PCS = 0; PROF_NUM_PCS < count; PROF_NUM_PCS++)
+    {
+      prof_pc_t *pc = &PROF_PCS[PROF_NUM_PCS];
+
+      if (!prof_get (f, &val, 4))
+        goto fail;
+      pc->slot = val;
+      if (!prof_get (f, &val, 2))
+        goto fail;
+      pc->addr = val;
+      if (!prof_get (f, &pc->cycles, 8))
+        goto fail;
+    }
+
+  fclose (f);
+  return true;
+
+fail:
+  fclose (f);
+  return false;
+}
+
+static int
+prof_label_cmp (const void *a, const void *b)
+{
+  const prof_label_t *x = a, *y = b;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static bool
+prof_load_labels (const char *path)
+{
+  char line[256];
+  size_t capacity = 0;
+  FILE *f = fopen (path, "r");
+
+  if (f == NULL)
+    return false;
+
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      unsigned addr;
+      char name[PROF_LABEL_LEN];
+
+      if (sscanf (line, "al %x .%63s", &addr, name) != 2)
+        continue;
+      if (PROF_NUM_LABELS == capacity)
+        {
+          size_t grown = capacity ? 2 * capacity : 256;
+          prof_label_t *labels
+              = realloc (PROF_LABELS, grown * sizeof (*labels));
+          if (labels == NULL)
+            {
+              fclose (f);
+              return false;
+            }
+          PROF_LABELS = labels;
+          capacity = grown;
+        }
+      PROF_LABELS[PROF_NUM_LABELS].addr = addr;
+      strcpy (PROF_LABELS[PROF_NUM_LABELS].name, name);
+      PROF_NUM_LABELS++;
+    }
+
+  fclose (f);
+  qsort (PROF_LABELS, PROF_NUM_LABELS, sizeof (*PROF_LABELS),
+         prof_label_cmp);
+  return true;
+}
+
+static const char *
+prof_symbol (uint16_t addr)
+{
+  size_t lo = 0, hi = PROF_NUM_LABELS;
+
+  // The last label at or below `addr'
+  while (lo < hi)
+    {
+      size_t mid = (lo + hi) / 2;
+      if (PROF_LABELS[mid].addr <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return lo == 0 ? "?" : PROF_LABELS[lo - 1].name;
+}
+
+static void
+prof_print_folded (void)
+{
+  for (uint32_t i = 0; i < PROF_NUM_PCS; i++)
+    {
+      const prof_pc_t *pc = &PROF_PCS[i];
+
+      if (pc->slot < PROFILE_ROM_SLOT)
+        printf ("bus;");
+      else
+        printf ("prg:%02X;",
+                (pc->slot - PROFILE_ROM_SLOT) >> PROF_BANK_SHIFT);
+      printf ("%s;$%04X %llu\n", prof_symbol (pc->addr), pc->addr,
+              (unsigned long long)pc->cycles);
+    }
+}
+
+static void
+prof_print_summary (void)
+{
+  uint64_t total = 0;
+
+  for (int i = 0; i <= UCHAR_MAX; i++)
+    total += PROF_OPS[i].cycles;
+
+  printf ("%-3s %-3s %12s %12s %6s %10s %10s %10s\n", "op", "", "instrs",
+          "cycles", "%", "page", "taken", "br. page");
+
+  for (int i = 0; i <= UCHAR_MAX; i++)
+    {
+      const cpu_profile_op_t *op = &PROF_OPS[i];
+
+      if (op->instrs == 0)
+        continue;
+      printf ("$%02X %-3s %12llu %12llu %6.2f %10llu %10llu %10llu\n", i,
+              DISPATCH_INFO[i].mnemonic, (unsigned long long)op->instrs,
+              (unsigned long long)op->cycles,
+              total ? 100.0 * op->cycles / total : 0.0,
+              (unsigned long long)op->page_cross,
+              (unsigned long long)op->branch_taken,
+              (unsigned long long)op->branch_cross);
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  bool summary = argc > 1 && strcmp (argv[1], "-s") == 0;
+  int arg = summary ? 2 : 1;
+
+  if (arg >= argc || argc > arg + 2)
+    {
+      fprintf (stderr, "usage: %s [-s] DUMP [LABELS]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (!prof_load_dump (argv[arg]))
+    {
+      fprintf (stderr, "%s: not a readable profile dump\n", argv[arg]);
+      return EXIT_FAILURE;
+    }
+
+  if (arg + 1 < argc && !prof_load_labels (argv[arg + 1]))
+    {
+      fprintf (stderr, "%s: cannot read labels\n", argv[arg + 1]);
+      return EXIT_FAILURE;
+    }
+
+  if (summary)
+    prof_print_summary ();
+  else
+    prof_print_folded ();
+  return EXIT_SUCCESS;
+}
@@ -7,11 +7,15 @@
 #include <string.h>
 
 #define MEM_SIZE 0x10000
+#define RAM_SIZE 0x0800
+#define RAM_END 0x1FFF
 #define ZERO_PAGE_BEGIN 0x0
 #define ZERO_PAGE_END 0xFF
 #define STACK_START 0x0100
 #define STACK_END 0x01FF
-#define PAGE_SIZE 0xFF
+#define PAGE_SIZE 0x100
+#define NUM_PAGES 0x100
+#define CPU_CACHE_LINE 64
 
 #define MASK_BYTE 0xFF
 #define MASK_WORD 0xFFFF
@@ -25,9 +29,20 @@
 #define VECADDR_RESET 0xFFFC
 #define VECADDR_IRQ 0xFFFE
 
-#define FLAG_SET 1
-#define FLAG_UNSET 0
-#define FLAG_ERROR -1
+#define CPU_IRQ_MAPPER 0x01
+#define CPU_IRQ_FRAME 0x02
+#define CPU_IRQ_DMC 0x04
+
+#define STATUS_N 0x80
+#define STATUS_V 0x40
+#define STATUS_X 0x20
+#define STATUS_B 0x10
+#define STATUS_D 0x08
+#define STATUS_I 0x04
+#define STATUS_Z 0x02
+#define STATUS_C 0x01
+
+#define MASK_NZ_FORCE_N 0x8000
 
 #define ADDRMODE_ACC 0
 #define ADDRMODE_ABS 1
@@ -54,101 +69,614 @@
 #define SPECIALCASE_PAGE_CROSS 1
 #define SPECIALCASE_BRANCH_CROSS 2
 
-#define GET_PAGE (addr) ((addr >> 8) & MASK_BYTE)
+#define GET_PAGE(addr) (((addr) >> 8) & MASK_BYTE)
 
-#define BITFIELD_STRUTER (bf) (*((uint8_t *)&bf))
-#define BITFIELD_DESTRUTER (bf, num) (*((uint8_t *)&bf) = num)
+#define BLOCK_MAX_INSTRS 16
+#define BLOCK_CACHE_SIZE 512
+
+#define PROFILE_ROM_SLOT 0x10000
+#define PROFILE_MAGIC "6502PRF1"
 
 typedef uint8_t special_case_t;
-typedef char flag_t;
 typedef uint8_t flag_modstat;
 typedef int addr_mode_t;
 
 typedef uint8_t (*rmwutil_fn_t) (uint8_t);
 typedef void (*itc_fn_t) (void);
 typedef void (*resolver_fn_t) (void);
-typedef uint16_t (*addrwrap_fn_t) (uint16_t);
+typedef uint8_t (*mmio_read_fn_t) (uint16_t);
+typedef void (*mmio_write_fn_t) (uint16_t, uint8_t);
+typedef uint64_t (*mmio_stable_fn_t) (uint16_t);
 
-static struct
+typedef struct
 {
-  uint8_t AC;
+  uint8_t ACC;
   uint8_t XR;
   uint8_t YR;
   uint8_t SP;
   uint16_t PC;
 
   uint64_t total_cycles;
+  uint64_t total_instrs;
   bool running;
+  bool run_ended;
 
   bool pending_NMI;
   bool pending_RESET;
   bool pending_IRQ;
-} CPU;
+  uint8_t irq_lines;
+} cpu_regs_t;
 
-static struct
+typedef struct
 {
-  uint8_t N : 1;
-  uint8_t V : 1;
-  uint8_t X : 1;
-  uint8_t B : 1;
-  uint8_t D : 1;
-  uint8_t I : 1;
-  uint8_t Z : 1;
-  uint8_t C : 1;
-} FLAGS;
+  uint16_t NZ;
+  uint8_t C;
+  uint8_t V;
+  uint8_t I;
+  uint8_t D;
+} cpu_flags_t;
 
-static struct
+typedef struct
 {
   addr_mode_t mode;
   uint16_t eff_addr;
   uint8_t fetched;
   bool page_crossed;
-} ADDR;
+} cpu_addr_t;
+
+// What the cores read for every instruction they dispatch; the names and
+// flag effects only tools look at are kept apart in dispatch_info_t, so
+// the table stays 24 bytes an entry.
 
-static struct
+typedef struct
 {
-  const char *mnemonic;
-  uint8_t opcode;
-  uint8_t size_bytes;
-  uint8_t added_cycles;
   resolver_fn_t resolver_fn;
   itc_fn_t itc_fn;
+  uint8_t opcode;
+  uint8_t size_bytes;
+  uint8_t num_cycles;
   special_case_t special_case;
+} dispatch_entry_t;
+
+typedef struct
+{
+  const char *mnemonic;
   flag_modstat action_N;
   flag_modstat action_Z;
   flag_modstat action_C;
   flag_modstat action_I;
   flag_modstat action_D;
   flag_modstat action_V;
-} DISPATCH;
+} dispatch_info_t;
 
-static struct
+typedef struct
 {
   uint8_t byte;
   uint16_t word;
-} OPERAND;
+} cpu_operand_t;
 
-static struct
+// The page table of the whole bus, most used first, and the console's
+// 2 KiB of work RAM, mirrored up to $1FFF. The rest of the bus belongs
+// to the PPU, the APU and the cartridge, which map themselves in.
+
+typedef struct
 {
-  static uint8_t contents[MEM_SIZE] = { 0 };
+  uint8_t *read_page[NUM_PAGES] __attribute__ ((aligned (CPU_CACHE_LINE)));
+  uint8_t *write_page[NUM_PAGES];
+  mmio_read_fn_t read_fn[NUM_PAGES];
+  mmio_write_fn_t write_fn[NUM_PAGES];
+  uint64_t dirty[NUM_PAGES / 64];
   int base_page;
-  addrwrap_fn_t wrapaddr_fn;
-} MEMORY;
+  uint8_t home_page[NUM_PAGES];
+  uint32_t writes[NUM_PAGES];
+  mmio_stable_fn_t stable_fn[NUM_PAGES];
+  uint8_t ram[RAM_SIZE] __attribute__ ((aligned (CPU_CACHE_LINE)));
+} cpu_memory_t;
+
+typedef struct
+{
+  uint8_t opcode;
+  uint16_t operand;
+  uint16_t next_pc;
+} cpu_decoded_t;
+
+typedef struct
+{
+  const uint8_t *bytes;
+  uint32_t writes;
+  uint16_t pc;
+  uint8_t home_page;
+  uint8_t count;
+  uint16_t max_cycles;
+  bool idle;
+  cpu_decoded_t instrs[BLOCK_MAX_INSTRS];
+} cpu_block_t;
+
+typedef struct
+{
+  uint64_t loops;
+  uint64_t cycles;
+  uint64_t instrs;
+} cpu_idle_stats_t;
+
+typedef struct
+{
+  bool enabled;
+  const cpu_block_t *block;
+  cpu_regs_t regs;
+  cpu_flags_t flags;
+  cpu_idle_stats_t stats;
+} cpu_idle_t;
+
+#ifdef CPU_PROFILE
+typedef struct
+{
+  uint64_t instrs;
+  uint64_t cycles;
+  uint64_t page_cross;
+  uint64_t branch_taken;
+  uint64_t branch_cross;
+} cpu_profile_op_t;
+
+typedef struct
+{
+  const uint8_t *rom;
+  uint32_t rom_size;
+  uint32_t page_slot[NUM_PAGES];
+  uint8_t *rom_page;
+  uint64_t *cycles;
+  cpu_profile_op_t ops[UCHAR_MAX + 1];
+} cpu_profile_t;
+#endif
+
+// CPU Context
+//
+// Everything one machine's CPU owns, so that any number of machines can
+// live in one process. Each thread runs the context it last selected
+// with cpu_context_select; the names below resolve through it, so the
+// rest of the core reads as if the state were plain globals. A thread
+// that never selects one uses a default context, which is only safe
+// while a single thread does so.
+//
+// The accessor is a plain load of the thread's pointer, which the
+// compiler may not carry across a call that could select another
+// context. A context must still not be switched from inside cpu_run or
+// a bus handler, since the cores keep state of the one they started on.
+//
+// The state every instruction touches comes first: the registers, flags
+// and the instruction in flight share the first cache line, and the
+// page table starts on the next. The block cache, and the profile that
+// only CPU_PROFILE builds carry, are many times the rest and are only
+// reached on a block's entry or through a count, so they live in a cold
+// part placed apart from the context.
+
+typedef struct
+{
+  cpu_block_t blocks[BLOCK_CACHE_SIZE]
+      __attribute__ ((aligned (CPU_CACHE_LINE)));
+#ifdef CPU_PROFILE
+  cpu_profile_t profile;
+#endif
+} cpu_cold_t;
+
+typedef struct cpu_context
+{
+  cpu_regs_t cpu;
+  cpu_flags_t flags;
+  cpu_addr_t addr;
+  const dispatch_entry_t *dispatch;
+  cpu_operand_t operand;
+  cpu_cold_t *cold;
+  cpu_memory_t memory;
+  cpu_idle_t idle;
+} cpu_context_t;
+
+static cpu_cold_t CPU_DEFAULT_COLD;
+static cpu_context_t CPU_DEFAULT_CONTEXT = { .cold = &CPU_DEFAULT_COLD };
+static _Thread_local cpu_context_t *CPU_CONTEXT = &CPU_DEFAULT_CONTEXT;
+
+static inline cpu_context_t *
+cpu_context_get (void)
+{
+  return CPU_CONTEXT;
+}
+
+#define CPU (cpu_context_get ()->cpu)
+#define FLAGS (cpu_context_get ()->flags)
+#define ADDR (cpu_context_get ()->addr)
+#define DISPATCH (cpu_context_get ()->dispatch)
+#define OPERAND (cpu_context_get ()->operand)
+#define MEMORY (cpu_context_get ()->memory)
+#define BLOCKS (cpu_context_get ()->cold->blocks)
+#define IDLE (cpu_context_get ()->idle)
+#define PROFILE (cpu_context_get ()->cold->profile)
+
+// A host that lays out a machine in memory of its own, to make it one
+// allocation, places the context at a CPU_CACHE_LINE-aligned offset of
+// cpu_context_size bytes, and its cold part at another of
+// cpu_context_cold_size bytes, away from the hot state of the machine.
+// cpu_context_release frees what a placed context owns, leaving the
+// memory to be placed in again or freed by the host; cpu_context_new
+// and cpu_context_free do both halves.
+
+size_t
+cpu_context_size (void)
+{
+  return sizeof (cpu_context_t);
+}
+
+size_t
+cpu_context_cold_size (void)
+{
+  return sizeof (cpu_cold_t);
+}
+
+cpu_context_t *
+cpu_context_place (void *mem, void *cold)
+{
+  cpu_context_t *ctx = memset (mem, 0, sizeof (cpu_context_t));
+
+  ctx->cold = memset (cold, 0, sizeof (cpu_cold_t));
+  return ctx;
+}
+
+void
+cpu_context_release (cpu_context_t *ctx)
+{
+  if (CPU_CONTEXT == ctx)
+    CPU_CONTEXT = &CPU_DEFAULT_CONTEXT;
+#ifdef CPU_PROFILE
+  free (ctx->cold->profile.rom_page);
+  free (ctx->cold->profile.cycles);
+  ctx->cold->profile.rom_page = NULL;
+  ctx->cold->profile.cycles = NULL;
+#endif
+}
+
+// The cold part follows the context in the same allocation.
+
+cpu_context_t *
+cpu_context_new (void)
+{
+  uint8_t *mem = aligned_alloc (CPU_CACHE_LINE, sizeof (cpu_context_t)
+                                                    + sizeof (cpu_cold_t));
+
+  return mem != NULL ? cpu_context_place (mem, mem + sizeof (cpu_context_t))
+                     : NULL;
+}
+
+void
+cpu_context_free (cpu_context_t *ctx)
+{
+  cpu_context_release (ctx);
+  free (ctx);
+}
+
+void
+cpu_context_select (cpu_context_t *ctx)
+{
+  CPU_CONTEXT = ctx;
+}
+
+cpu_context_t *
+cpu_context_current (void)
+{
+  return CPU_CONTEXT;
+}
+
+// Profiling
+//
+// Built with CPU_PROFILE, the indirect core (which cpu_run then uses)
+// counts guest cycles per PC and per opcode. A PC in the ROM handed to
+// cpu_profile_rom counts against its ROM offset rather than its address,
+// so banks switched through one window are told apart; every other PC
+// counts against its bus address, in the first 64K slots. An interrupt
+// entry is charged to the first instruction of its handler. Per opcode,
+// the page-cross and branch penalties paid are counted as well.
+//
+// cpu_profile_dump writes the counters out, little-endian:
+//
+//     "6502PRF1", u32 ROM size, u32 PC count,
+//     256 x { u64 instrs, cycles, page cross, branch taken, branch cross },
+//     PC count x { u32 slot, u16 address last mapped at, u64 cycles }
+//
+// 6502-profile.c turns that into flame graph input. Without CPU_PROFILE
+// the hooks below are empty and the cores carry no trace of them.
+
+#ifdef CPU_PROFILE
+
+// Counts PCs in ROM (which may be NULL) per byte from now on. The ROM
+// must be given before it is mapped; the counters start over unless it
+// is the one already given.
+
+bool
+cpu_profile_rom (const uint8_t *rom, uint32_t size)
+{
+  if (PROFILE.cycles != NULL && PROFILE.rom == rom
+      && PROFILE.rom_size == size)
+    return true;
+
+  uint64_t *cycles = calloc (PROFILE_ROM_SLOT + size, sizeof (*cycles));
+  uint8_t *rom_page = calloc (size / PAGE_SIZE + 1, 1);
+
+  if (cycles == NULL || rom_page == NULL)
+    {
+      free (cycles);
+      free (rom_page);
+      return false;
+    }
+
+  free (PROFILE.cycles);
+  free (PROFILE.rom_page);
+  PROFILE.cycles = cycles;
+  PROFILE.rom_page = rom_page;
+  PROFILE.rom = rom;
+  PROFILE.rom_size = size;
+  memset (PROFILE.ops, 0, sizeof (PROFILE.ops));
+  for (int page = 0; page < NUM_PAGES; page++)
+    PROFILE.page_slot[page] = page << 8;
+  return true;
+}
+
+void
+cpu_profile_clear (void)
+{
+  memset (PROFILE.cycles, 0,
+          (PROFILE_ROM_SLOT + PROFILE.rom_size) * sizeof (*PROFILE.cycles));
+  memset (PROFILE.ops, 0, sizeof (PROFILE.ops));
+}
+
+static void
+cpu_profile_map (int page, const uint8_t *bytes)
+{
+  uintptr_t offset = (uintptr_t)bytes - (uintptr_t)PROFILE.rom;
+
+  if (PROFILE.rom == NULL || bytes == NULL || offset >= PROFILE.rom_size)
+    {
+      PROFILE.page_slot[page] = page << 8;
+      return;
+    }
+  PROFILE.page_slot[page] = PROFILE_ROM_SLOT + offset;
+  PROFILE.rom_page[offset >> 8] = page;
+}
+
+static inline void
+cpu_profile_count (uint16_t pc, uint64_t entry_cycles, uint64_t cycles)
+{
+  cpu_profile_op_t *op = &PROFILE.ops[DISPATCH->opcode];
+  uint64_t penalty = cycles - DISPATCH->num_cycles;
+
+  PROFILE.cycles[PROFILE.page_slot[GET_PAGE (pc)] + (pc & MASK_BYTE)]
+      += entry_cycles + cycles;
+  op->instrs++;
+  op->cycles += cycles;
+  if (DISPATCH->special_case == SPECIALCASE_PAGE_CROSS)
+    op->page_cross += penalty;
+  else if (DISPATCH->special_case == SPECIALCASE_BRANCH_CROSS)
+    {
+      op->branch_taken += penalty != 0;
+      op->branch_cross += penalty == 2;
+    }
+}
+
+static void
+cpu_profile_put (FILE *f, uint64_t val, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+    putc ((val >> (8 * i)) & MASK_BYTE, f);
+}
+
+bool
+cpu_profile_dump (const char *path)
+{
+  uint32_t slots = PROFILE_ROM_SLOT + PROFILE.rom_size;
+  uint32_t count = 0;
+  FILE *f = fopen (path, "wb");
+
+  if (f == NULL)
+    return false;
+
+  for (uint32_t slot = 0; slot < slots; slot++)
+    count += PROFILE.cycles[slot] != 0;
+
+  fputs (PROFILE_MAGIC, f);
+  cpu_profile_put (f, PROFILE.rom_size, 4);
+  cpu_profile_put (f, count, 4);
+
+  for (int i = 0; i <= UCHAR_MAX; i++)
+    {
+      const cpu_profile_op_t *op = &PROFILE.ops[i];
+
+      cpu_profile_put (f, op->instrs, 8);
+      cpu_profile_put (f, op->cycles, 8);
+      cpu_profile_put (f, op->page_cross, 8);
+      cpu_profile_put (f, op->branch_taken, 8);
+      cpu_profile_put (f, op->branch_cross, 8);
+    }
+
+  for (uint32_t slot = 0; slot < slots; slot++)
+    {
+      uint16_t addr = slot;
+
+      if (PROFILE.cycles[slot] == 0)
+        continue;
+      if (slot >= PROFILE_ROM_SLOT)
+        addr = PROFILE.rom_page[(slot - PROFILE_ROM_SLOT) >> 8] << 8
+               | (slot & MASK_BYTE);
+      cpu_profile_put (f, slot, 4);
+      cpu_profile_put (f, addr, 2);
+      cpu_profile_put (f, PROFILE.cycles[slot], 8);
+    }
+
+  bool ok = !ferror (f);
+  return fclose (f) == 0 && ok;
+}
+
+#else
+
+static inline void
+cpu_profile_map (int page, const uint8_t *bytes)
+{
+  (void)page;
+  (void)bytes;
+}
+
+static inline void
+cpu_profile_count (uint16_t pc, uint64_t entry_cycles, uint64_t cycles)
+{
+  (void)pc;
+  (void)entry_cycles;
+  (void)cycles;
+}
+
+#endif
+
+// Memory Map
+//
+// The 64 KiB bus is split into 256 pages of 256 bytes. A page is either
+// backed by memory, in which case `read_page'/`write_page' point at the
+// bytes it maps and an access is a single pointer add, or it is MMIO
+// and the access goes through `read_fn'/`write_fn'. A page that can be
+// read but not written (ROM) has a NULL `write_page' and a `write_fn'
+// that drops the value, or the mapper's register handler. Mirrors are
+// pages pointing at the same bytes, and mappers switch banks by mapping
+// the window's pages again. cpu_init maps the work RAM and leaves every
+// other page reading open bus until its owner maps it.
+//
+// `home_page' names the first page of a mapping that holds the same
+// bytes, so that a write through any mirror counts against one page in
+// `writes'. The block core uses the count to notice code being
+// overwritten. Mirrors made by separate cpu_mem_map calls are not
+// folded.
+//
+// An MMIO page may also have a `stable_fn', which returns the CPU cycle
+// before which every read of `addr' gives the same value and has no
+// side effect (0 if its owner cannot say). It lets the block core skip
+// loops that poll the page.
+//
+// Not every program built on this file maps ROM writes or stable pages,
+// so those two are marked unused, as are cpu_init and the cores that
+// cpu_run does not pick.
+
+static uint8_t
+cpu_mem_read_open_bus (uint16_t addr)
+{
+  return GET_PAGE (addr);
+}
+
+static void
+cpu_mem_write_ignore (uint16_t addr, uint8_t val)
+{
+  (void)addr;
+  (void)val;
+}
+
+static void
+cpu_mem_map (uint16_t begin, uint16_t end, uint8_t *base, uint32_t size,
+             bool writable)
+{
+  for (int page = GET_PAGE (begin); page <= GET_PAGE (end); page++)
+    {
+      uint32_t offset = ((page << 8) - begin) % size;
+      uint8_t *bytes = base + offset;
+
+      MEMORY.read_page[page] = bytes;
+      MEMORY.home_page[page] = GET_PAGE (begin) + (offset >> 8);
+      MEMORY.read_fn[page] = NULL;
+      MEMORY.write_page[page] = writable ? bytes : NULL;
+      MEMORY.write_fn[page] = writable ? NULL : cpu_mem_write_ignore;
+      MEMORY.stable_fn[page] = NULL;
+      cpu_profile_map (page, bytes);
+    }
+}
+
+__attribute__ ((unused)) static void
+cpu_mem_map_rom_writes (uint16_t begin, uint16_t end, mmio_write_fn_t write_fn)
+{
+  for (int page = GET_PAGE (begin); page <= GET_PAGE (end); page++)
+    MEMORY.write_fn[page] = write_fn;
+}
+
+static void
+cpu_mem_map_mmio (uint16_t begin, uint16_t end, mmio_read_fn_t read_fn,
+                  mmio_write_fn_t write_fn)
+{
+  for (int page = GET_PAGE (begin); page <= GET_PAGE (end); page++)
+    {
+      MEMORY.read_page[page] = NULL;
+      MEMORY.write_page[page] = NULL;
+      MEMORY.read_fn[page] = read_fn ? read_fn : cpu_mem_read_open_bus;
+      MEMORY.write_fn[page] = write_fn ? write_fn : cpu_mem_write_ignore;
+      MEMORY.stable_fn[page] = NULL;
+      cpu_profile_map (page, NULL);
+    }
+}
+
+__attribute__ ((unused)) static void
+cpu_mem_map_stable (uint16_t begin, uint16_t end, mmio_stable_fn_t stable_fn)
+{
+  for (int page = GET_PAGE (begin); page <= GET_PAGE (end); page++)
+    MEMORY.stable_fn[page] = stable_fn;
+}
 
 // Raw Memory Operations -- Byte
 
-static inline uint8_t
+__attribute__ ((always_inline)) static inline uint8_t
 cpu_mem_read_byte (uint16_t addr)
 {
-  addr = MEMORY.wrapaddr_fn (addr);
-  return MEMORY.contents[addr];
+  uint8_t *page = MEMORY.read_page[GET_PAGE (addr)];
+
+  if (page != NULL)
+    return page[addr & MASK_BYTE];
+  return MEMORY.read_fn[GET_PAGE (addr)](addr);
 }
 
-static inline void
+__attribute__ ((always_inline)) static inline void
 cpu_mem_write_byte (uint16_t addr, uint8_t val)
 {
-  addr = MEMORY.wrapaddr_fn (addr);
-  MEMORY.contents[addr] = val;
+  uint8_t *page = MEMORY.write_page[GET_PAGE (addr)];
+
+  if (page != NULL)
+    {
+      page[addr & MASK_BYTE] = val;
+      MEMORY.dirty[GET_PAGE (addr) >> 6] |= 1ULL << (GET_PAGE (addr) & 63);
+      MEMORY.writes[MEMORY.home_page[GET_PAGE (addr)]]++;
+    }
+  else
+    MEMORY.write_fn[GET_PAGE (addr)](addr, val);
+}
+
+// A read-modify-write writes back the value it read, then the result,
+// on consecutive cycles. Only a register can tell the two apart, so a
+// page backed by memory gets the result alone.
+
+__attribute__ ((always_inline)) static inline void
+cpu_mem_write_rmw (uint16_t addr, uint8_t old, uint8_t new)
+{
+  if (MEMORY.write_page[GET_PAGE (addr)] == NULL)
+    MEMORY.write_fn[GET_PAGE (addr)](addr, old);
+  cpu_mem_write_byte (addr, new);
+}
+
+// Dirty Page Tracking
+//
+// Every write through a page pointer marks its bus page. Snapshots take
+// the set and copy only those pages; mirrors of one page show up as
+// several bits pointing at the same bytes, which the caller folds. A
+// NULL `dirty' just clears the set.
+
+void
+cpu_mem_dirty_take (uint64_t dirty[NUM_PAGES / 64])
+{
+  if (dirty != NULL)
+    memcpy (dirty, MEMORY.dirty, sizeof (MEMORY.dirty));
+  memset (MEMORY.dirty, 0, sizeof (MEMORY.dirty));
+}
+
+uint8_t *
+cpu_mem_page (uint8_t page)
+{
+  return MEMORY.write_page[page];
 }
 
 // Raw Memory Operations -- Word
@@ -175,7 +703,7 @@ cpu_mem_write_word (uint16_t addr, uint16_t val)
 static inline uint8_t
 cpu_zpg_read_byte (uint8_t zp_addr)
 {
-  return cpu_zpg_read_byte ((uint16_t)zp_addr);
+  return cpu_mem_read_byte ((uint16_t)zp_addr);
 }
 
 static inline void
@@ -186,7 +714,7 @@ cpu_zpg_write_byte (uint8_t zp_addr, uint8_t val)
 
 // Zero Page Memory Operations -- Word
 
-static inline uint8_t
+static inline uint16_t
 cpu_zpg_read_word (uint8_t zp_addr)
 {
   uint8_t lo = cpu_zpg_read_byte (zp_addr);
@@ -208,22 +736,22 @@ cpu_zpg_write_word (uint8_t zp_addr, uint16_t val)
 static inline void
 cpu_stack_push_byte (uint8_t val)
 {
-  cpu_mem_write_byte (CPU.SP--, val);
+  cpu_mem_write_byte (STACK_START + CPU.SP--, val);
 }
 
 static inline uint8_t
 cpu_stack_pop_byte (void)
 {
-  return cpu_mem_read_byte (++CP.SP);
+  return cpu_mem_read_byte (STACK_START + ++CPU.SP);
 }
 
 // Stack Operations -- Word
 
 static inline void
-cpu_stack_push_word (uint8_t val)
+cpu_stack_push_word (uint16_t val)
 {
-  uint8_t hi = (val >> 8) && MASK_BYTE;
-  uint8_t lo = val && MASK_BYTE;
+  uint8_t hi = (val >> 8) & MASK_BYTE;
+  uint8_t lo = val & MASK_BYTE;
   cpu_stack_push_byte (hi);
   cpu_stack_push_byte (lo);
 }
@@ -237,166 +765,55 @@ cpu_stack_pop_word (void)
 }
 
 // Flag Operations
+//
+// N and Z are evaluated lazily. Instructions that affect them only store
+// their result in FLAGS.NZ, and the flags are derived when a branch, a
+// status push or an interrupt reads them. Z is set when the low byte is
+// zero and N is bit 7 of either byte, so bit 15 can force N for BIT,
+// PLP and RTI, where N does not come from the byte that decides Z.
+// C, V, I and D are plain bytes holding 0 or 1.
 
-static inline flag_modstatus_t
-cpu_flag_toggle (flag_t flag)
+static inline void
+cpu_flag_set_nz (uint8_t result)
 {
-  switch (flag)
-    {
-    case 'N':
-      FLAGS.N = !FLAGS.N;
-      return FLAGS.N;
-    case 'V':
-      FLAGS.V = !FLAGS.V;
-      return FLAGS.V;
-    case 'B':
-      FLAGS.B = !FLAGS.B;
-      return FLAGS.B;
-    case 'D':
-      FLAGS.D = !FLAGS.D;
-      return FLAGS.D;
-    case 'X':
-      FLAGS.X = !FLAGS.X;
-      return FLAGS.X;
-    case 'I':
-      FLAGS.I = !FLAGS.I;
-      return STATIS.I;
-    case 'Z':
-      FLAGS.Z = !FLAGS.Z;
-      return FLAGS.Z;
-    case 'C':
-      FLAGS.C = !FLAGS.C;
-      return FLAGS.C;
-    default:
-      return FLAG_ERROR;
-    }
-
-  return FLAG_ERROR;
+  FLAGS.NZ = result;
 }
 
-static inline bool
-cpu_flag_is_set (flag_t flag)
+static inline void
+cpu_flag_set_nz_bits (bool n, bool z)
 {
-  switch (flag)
-    {
-    case 'N':
-      return FLAGS.N == FLAG_SET;
-    case 'V':
-      return FLAGS.V == FLAG_SET;
-    case 'B':
-      return FLAGS.B == FLAG_SET;
-    case 'D':
-      return FLAGS.D == FLAG_SET;
-    case 'X':
-      return FLAGS.X == FLAG_SET;
-    case 'I':
-      return STATIS.I == FLAG_SET;
-    case 'Z':
-      return FLAGS.Z == FLAG_SET;
-    case 'C':
-      return FLAGS.C == FLAG_SET;
-    default:
-      return false;
-    }
-
-  return false;
+  FLAGS.NZ = (n ? MASK_NZ_FORCE_N : 0) | (z ? 0 : 1);
 }
 
 static inline bool
-cpu_flag_is_unset (flag_t flag)
-{
-  return !cpu_flag_is_set (flag);
-}
-
-static inline void
-cpu_flag_set (flag_t flag)
+cpu_flag_n (void)
 {
-  switch (flag)
-    {
-    case 'N':
-      FLAGS.N = FLAG_SET;
-      return;
-    case 'V':
-      FLAGS.V = FLAG_SET;
-      return;
-    case 'B':
-      FLAGS.B = FLAG_SET;
-      return;
-    case 'D':
-      FLAGS.D = FLAG_SET;
-      return;
-    case 'X':
-      FLAGS.X = FLAG_SET;
-      return;
-    case 'I':
-      STATIS.I = FLAG_SET;
-      return;
-    case 'Z':
-      FLAGS.Z = FLAG_SET;
-      return;
-    case 'C':
-      FLAGS.C = FLAG_SET;
-      return;
-    default:
-      return;
-    }
+  return ((FLAGS.NZ >> 8) | FLAGS.NZ) & MASK_COMPLEMENT;
 }
 
-static inline void
-cpu_flag_unset (flag_t flag)
+static inline bool
+cpu_flag_z (void)
 {
-  switch (flag)
-    {
-    case 'N':
-      FLAGS.N = FLAG_UNSET;
-      return;
-    case 'V':
-      FLAGS.V = FLAG_UNSET;
-      return;
-    case 'B':
-      FLAGS.B = FLAG_UNSET;
-      return;
-    case 'D':
-      FLAGS.D = FLAG_UNSET;
-      return;
-    case 'X':
-      FLAGS.X = FLAG_UNSET;
-      return;
-    case 'I':
-      STATIS.I = FLAG_UNSET;
-      return;
-    case 'Z':
-      FLAGS.Z = FLAG_UNSET;
-      return;
-    case 'C':
-      FLAGS.C = FLAG_UNSET;
-      return;
-    default:
-      return;
-    }
+  return (FLAGS.NZ & MASK_BYTE) == 0;
 }
 
-static inline void
-cpu_flag_set_if (flag_t flag, bool cond)
+static inline uint8_t
+cpu_flag_pack (uint8_t extra_bits)
 {
-  if (cond)
-    cpu_flag_set (flag);
-  else
-    cpu_flag_unset (flag);
+  return (cpu_flag_n () ? STATUS_N : 0) | (FLAGS.V ? STATUS_V : 0)
+         | (FLAGS.D ? STATUS_D : 0) | (FLAGS.I ? STATUS_I : 0)
+         | (cpu_flag_z () ? STATUS_Z : 0) | (FLAGS.C ? STATUS_C : 0)
+         | STATUS_X | extra_bits;
 }
 
 static inline void
-cpu_flag_toggle_zn (uint8_t value)
+cpu_flag_unpack (uint8_t status)
 {
-  if (value & MASK_BYTE == 0)
-    cpu_flag_set ('Z');
-  else
-    cpu_flag_unset ('Z');
-
-  if (value & MASK_COMPLEMENT != 0)
-    cpu_flag_set ('N');
-  else
-    cpu_flag_unset ('N');
+  cpu_flag_set_nz_bits (status & STATUS_N, status & STATUS_Z);
+  FLAGS.V = (status & STATUS_V) != 0;
+  FLAGS.D = (status & STATUS_D) != 0;
+  FLAGS.I = (status & STATUS_I) != 0;
+  FLAGS.C = status & STATUS_C;
 }
 
 // Address Resolvers
@@ -410,7 +827,7 @@ cpu_resvladdr_byte_pc (void)
   return cpu_mem_read_byte (base);
 }
 
-static inline uint8_t
+static inline uint16_t
 cpu_resvladdr_word_pc (void)
 {
   uint16_t base = CPU.PC;
@@ -456,7 +873,7 @@ cpu_resvladdr_word_pc_indir (void)
 {
   uint16_t ptr = cpu_resvladdr_word_pc ();
   uint8_t lo = cpu_mem_read_byte (ptr);
-  uint8_t hi = cpu_mem_read_byte (ptr & 0xFF00 | ((ptr + 1) & 0x00FF));
+  uint8_t hi = cpu_mem_read_byte ((ptr & 0xFF00) | ((ptr + 1) & 0x00FF));
   return ((hi << 8) | lo);
 }
 
@@ -481,7 +898,7 @@ static inline uint16_t
 cpu_resvladdr_word_pc_rel (void)
 {
   uint8_t off8 = cpu_resvladdr_byte_pc ();
-  int8_t signd = (off8 >= 0x80) ? (off8 - 256) : (int8_t)off8;
+  int16_t signd = (off8 >= 0x80) ? (off8 - 256) : off8;
   uint16_t target = CPU.PC + signd;
   return target;
 }
@@ -491,25 +908,19 @@ cpu_resvladdr_word_pc_rel (void)
 static inline void
 cpu_status_save_flags (void)
 {
-  cpu_stack_push_byte (BITFIELD_STRUTER (FLAGS));
+  cpu_stack_push_byte (cpu_flag_pack (0));
 }
 
 static inline void
 cpu_status_save_modified_flags (void)
 {
-  int old_b = FLAGS.B;
-  int old_x = FLAGS.X;
-  FLAGS.B = 1;
-  FLAGS.X = 1;
-  cpu_status_save_flags ();
-  FLAGS.B = old_b;
-  FLAGS.X = old_x;
+  cpu_stack_push_byte (cpu_flag_pack (STATUS_B));
 }
 
 static inline void
 cpu_status_restore_flags (void)
 {
-  BITFIELD_DESTRUTER (FLAGS, cpu_stack_pop_byte ());
+  cpu_flag_unpack (cpu_stack_pop_byte ());
 }
 
 static inline void
@@ -527,16 +938,21 @@ cpu_status_restore_pc (void)
 static inline void
 cpu_status_save_acc (void)
 {
-  cpu_stack_push_byte (PC.ACC);
+  cpu_stack_push_byte (CPU.ACC);
 }
 
 static inline void
 cpu_status_restore_acc (void)
 {
-  PC.ACC = cpu_stack_pop_byte ();
+  CPU.ACC = cpu_stack_pop_byte ();
 }
 
 // Address Mode Operations
+//
+// Each mode that names a memory operand comes in two: `_ea' resolves
+// the effective address only, and the plain one also reads the operand
+// from it. Stores, JMP and JSR are dispatched to the `_ea' form, so a
+// store to an MMIO register is one write with no read before it.
 
 static void
 cpu_addrmode_impl (void)
@@ -559,64 +975,106 @@ cpu_addrmode_acc (void)
 static void
 cpu_addrmode_imm (void)
 {
-  addr.mode = ADDRMODE_IMM;
-  addr.eff_addr = 0;
-  addr.fetched = cpu_mem_read_byte (CPU.PC++);
-  addr.page_crossed = false;
+  ADDR.mode = ADDRMODE_IMM;
+  ADDR.eff_addr = 0;
+  ADDR.fetched = cpu_mem_read_byte (CPU.PC++);
+  ADDR.page_crossed = false;
 }
 
 static void
-cpu_addrmode_zpg (void)
+cpu_addrmode_zpg_ea (void)
 {
   ADDR.mode = ADDRMODE_ZPG;
   ADDR.eff_addr = cpu_resvladdr_byte_pc ();
-  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+  ADDR.fetched = 0;
   ADDR.page_crossed = false;
 }
 
 static void
-cpu_addrmode_zpgx (void)
+cpu_addrmode_zpg (void)
+{
+  cpu_addrmode_zpg_ea ();
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static void
+cpu_addrmode_zpgx_ea (void)
 {
   ADDR.mode = ADDRMODE_ZPGX;
   ADDR.eff_addr = cpu_resvladdr_byte_pc_xoffs ();
-  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+  ADDR.fetched = 0;
   ADDR.page_crossed = false;
 }
 
 static void
-cpu_addrmode_zpgy (void)
+cpu_addrmode_zpgx (void)
+{
+  cpu_addrmode_zpgx_ea ();
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static void
+cpu_addrmode_zpgy_ea (void)
 {
   ADDR.mode = ADDRMODE_ZPGY;
   ADDR.eff_addr = cpu_resvladdr_byte_pc_yoffs ();
-  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+  ADDR.fetched = 0;
   ADDR.page_crossed = false;
 }
 
 static void
-cpu_addrmode_abs (void)
+cpu_addrmode_zpgy (void)
+{
+  cpu_addrmode_zpgy_ea ();
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static void
+cpu_addrmode_abs_ea (void)
 {
   ADDR.mode = ADDRMODE_ABS;
   ADDR.eff_addr = cpu_resvladdr_word_pc ();
-  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+  ADDR.fetched = 0;
   ADDR.page_crossed = false;
 }
 
 static void
-cpu_addrmode_absx (void)
+cpu_addrmode_abs (void)
+{
+  cpu_addrmode_abs_ea ();
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static void
+cpu_addrmode_absx_ea (void)
 {
   ADDR.mode = ADDRMODE_ABSX;
   ADDR.eff_addr = cpu_resvladdr_word_pc_xoffs ();
+  ADDR.fetched = 0;
+  ADDR.page_crossed = MEMORY.base_page != GET_PAGE (ADDR.eff_addr);
+}
+
+static void
+cpu_addrmode_absx (void)
+{
+  cpu_addrmode_absx_ea ();
   ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
-  ADDR.page_crossed = MEMORY.base_page != get_page (ADDR.eff_addr);
 }
 
 static void
-cpu_addrmode_absy (void)
+cpu_addrmode_absy_ea (void)
 {
   ADDR.mode = ADDRMODE_ABSY;
   ADDR.eff_addr = cpu_resvladdr_word_pc_yoffs ();
+  ADDR.fetched = 0;
+  ADDR.page_crossed = MEMORY.base_page != GET_PAGE (ADDR.eff_addr);
+}
+
+static void
+cpu_addrmode_absy (void)
+{
+  cpu_addrmode_absy_ea ();
   ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
-  ADDR.page_crossed = memory.base_page != get_page (ADDR.eff_addr);
 }
 
 static void
@@ -629,107 +1087,308 @@ cpu_addrmode_ind (void)
 }
 
 static void
-cpu_addrmode_indx (void)
+cpu_addrmode_xind_ea (void)
 {
   ADDR.mode = ADDRMODE_XIND;
   ADDR.eff_addr = cpu_resvladdr_word_pc_indir_xoffs ();
-  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+  ADDR.fetched = 0;
   ADDR.page_crossed = false;
 }
 
 static void
-cpu_addrmode_yind (void)
+cpu_addrmode_xind (void)
 {
-  ADDR.mode = ADDRMODE_INDY;
-  ADDR.eff_addr = cpu_resvladdr_word_pc_indir_offsy ();
+  cpu_addrmode_xind_ea ();
   ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
-  ADDR.page_crossed = MEMORY.base_page != GET_PAGE (ADDR.eff_addr);
 }
 
 static void
-cpu_addrmode_rel (void)
+cpu_addrmode_yind_ea (void)
 {
-  ADDR.mode = ADDRMODE_REL;
-  ADDR.eff_addr = cpu_resvladdr_word_pc_rel ();
+  ADDR.mode = ADDRMODE_INDY;
+  ADDR.eff_addr = cpu_resvladdr_word_pc_indir_offsy ();
   ADDR.fetched = 0;
-  ADDR.page_crossed = false;
+  ADDR.page_crossed = MEMORY.base_page != GET_PAGE (ADDR.eff_addr);
 }
 
-// Arithmetic Helpers
-
 static void
-cpu_helper_adc_binary (uint8_t addend)
+cpu_addrmode_yind (void)
 {
-  int carry_in = cpu_flag_is_set ('C') ? 1 : 0;
-  uint8_t acc = CPU.ACC;
-  uint16_t sum9 = acc + addend + carry_in;
-  uint8_t result = sum9 & MASK_BYTE;
+  cpu_addrmode_yind_ea ();
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
 
-  bool overflow = ((((acc ^ addend) & MASK_COMPLEMENT) == 0)
-                   && (((acc ^ result) ^ MASK_COMPLMENT)) != 0);
+static void
+cpu_addrmode_rel (void)
+{
+  ADDR.mode = ADDRMODE_REL;
+  ADDR.eff_addr = cpu_resvladdr_word_pc_rel ();
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
 
-  cpu_flag_set_if ('C', sum9 > UCHAR_MAX);
-  cpu_flag_set_if ('V', overflow);
-  cpu_flag_toggle_zn (result);
+// Address Mode Operations -- Decoded Operands
+//
+// The same modes for the block core, which read the operand bytes once
+// when the block is decoded. Branch targets are resolved then as well.
+// Everything that depends on registers or on memory other than the
+// instruction itself is still done here.
 
-  CPU.ACC = result;
+static inline void
+cpu_blockmode_impl (uint16_t operand)
+{
+  (void)operand;
+  cpu_addrmode_impl ();
 }
 
-static void
-cpu_helper_adc_decimal (uint8_t addend)
+static inline void
+cpu_blockmode_acc (uint16_t operand)
 {
-  int carry_in = cpu_flag_is_set ('C') ? 1 : 0;
-  uint8_t acc = CPU.ACC;
+  (void)operand;
+  cpu_addrmode_acc ();
+}
 
-  uint16_t bin_sum = (acc + addend + carry_in);
-  uint8_t bin_res = bin_sum & MASK_BYTE;
+static inline void
+cpu_blockmode_imm (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_IMM;
+  ADDR.eff_addr = 0;
+  ADDR.fetched = operand;
+  ADDR.page_crossed = false;
+}
 
-  bool overflow = (((acc ^ addend) & MASK_COMPLEMENT) == 0)
-                  && (((acc ^ bin_res) & MASK_COMPLEMENT != 0));
+static inline void
+cpu_blockmode_zpg_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_ZPG;
+  ADDR.eff_addr = operand;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
 
-  uint8_t lo = (acc & MASK_BCD) + (addend & MASK_BCD) + carry_in;
-  uint8_t adjust_lo = 0;
+static inline void
+cpu_blockmode_zpg (uint16_t operand)
+{
+  cpu_blockmode_zpg_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
 
-  if (lo > 9)
-    {
-      lo += 6;
-      adjust_lo = 1;
-    }
+static inline void
+cpu_blockmode_zpgx_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_ZPGX;
+  ADDR.eff_addr = (uint8_t)(operand + CPU.XR);
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
 
-  uint8_t hi = (acc >> 4) + (addend >> 4) + adjust_lo;
-  bool carry_out = false;
+static inline void
+cpu_blockmode_zpgx (uint16_t operand)
+{
+  cpu_blockmode_zpgx_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
 
-  if (hi > 9)
-    {
-      hi += 6;
-      carry_out = true;
-    }
+static inline void
+cpu_blockmode_zpgy_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_ZPGY;
+  ADDR.eff_addr = (uint8_t)(operand + CPU.YR);
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
 
-  uint8_t result = ((hi << 4) | (lo MASK_BCD)) & MASK_BYTE;
+static inline void
+cpu_blockmode_zpgy (uint16_t operand)
+{
+  cpu_blockmode_zpgy_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_abs_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_ABS;
+  ADDR.eff_addr = operand;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
 
-  cpu_flag_set_if ('C', carry_out);
-  cpu_flag_set_if ('V', overflow);
-  cpu_flag_toggle_zn (result);
+static inline void
+cpu_blockmode_abs (uint16_t operand)
+{
+  cpu_blockmode_abs_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_absx_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_ABSX;
+  ADDR.eff_addr = operand + CPU.XR;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = GET_PAGE (operand) != GET_PAGE (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_absx (uint16_t operand)
+{
+  cpu_blockmode_absx_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_absy_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_ABSY;
+  ADDR.eff_addr = operand + CPU.YR;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = GET_PAGE (operand) != GET_PAGE (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_absy (uint16_t operand)
+{
+  cpu_blockmode_absy_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_ind (uint16_t operand)
+{
+  uint8_t lo = cpu_mem_read_byte (operand);
+  uint8_t hi = cpu_mem_read_byte ((operand & 0xFF00)
+                                  | ((operand + 1) & 0x00FF));
+
+  ADDR.mode = ADDRMODE_IND;
+  ADDR.eff_addr = (hi << 8) | lo;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
+
+static inline void
+cpu_blockmode_xind_ea (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_XIND;
+  ADDR.eff_addr = cpu_zpg_read_word (operand + CPU.XR);
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
+
+static inline void
+cpu_blockmode_xind (uint16_t operand)
+{
+  cpu_blockmode_xind_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_yind_ea (uint16_t operand)
+{
+  uint16_t base = cpu_zpg_read_word (operand);
+
+  ADDR.mode = ADDRMODE_INDY;
+  ADDR.eff_addr = base + CPU.YR;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = GET_PAGE (base) != GET_PAGE (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_yind (uint16_t operand)
+{
+  cpu_blockmode_yind_ea (operand);
+  ADDR.fetched = cpu_mem_read_byte (ADDR.eff_addr);
+}
+
+static inline void
+cpu_blockmode_rel (uint16_t operand)
+{
+  ADDR.mode = ADDRMODE_REL;
+  ADDR.eff_addr = operand;
+  ADDR.fetched = 0;
+  ADDR.page_crossed = false;
+}
+
+// Arithmetic Helpers
+//
+// The 2A03 has no decimal mode: D can be set, pushed and pulled, but ADC
+// and SBC ignore it. That is the default build, in which both are plain
+// binary adds, without a branch between them and the flags. Build with
+// CPU_DECIMAL_MODE for a generic 6502 whose ADC and SBC honour D; the
+// BCD digits are then corrected through BCD_ADJUST_*, indexed by the
+// raw nibble sum or difference, instead of by compares.
+
+static inline void
+cpu_helper_adc_binary (uint8_t addend)
+{
+  uint8_t acc = CPU.ACC;
+  uint16_t sum9 = acc + addend + FLAGS.C;
+  uint8_t result = sum9 & MASK_BYTE;
+
+  // Overflow: both inputs differ in sign from the result
+  FLAGS.C = sum9 >> 8;
+  FLAGS.V = (((acc ^ result) & (addend ^ result)) >> 7) & 1;
+  cpu_flag_set_nz (result);
 
   CPU.ACC = result;
 }
 
-static void
+static inline void
 cpu_helper_sbc_binary (uint8_t subtrahend)
 {
-  int carry_in = cpu_flag_is_set ('C') ? 1 : 0;
-  uint8_t acc = CPU.ACC;
-  uint8_t subtrahend_inverted = subtrahend ^ MASK_BYTE;
+  cpu_helper_adc_binary (subtrahend ^ MASK_BYTE);
+}
 
-  uint16_t sum9 = acc + subtrahend_inverted + carry_in;
-  uint8_t result = sum9 & MASK_BYTE;
+#ifdef CPU_DECIMAL_MODE
+
+// One BCD digit from a nibble sum of 0-31 (bits 0-3), and its carry
+// (bit 4)
+#define BCD_ADD(n) ((n) > 9 ? (((n) + 6) & MASK_BCD) | 0x10 : (n))
+
+// The same from a nibble difference of -16..15, indexed from -16, with
+// the borrow in bit 4
+#define BCD_SUB(n)                                                            \
+  ((n) < 16 ? (((n) - 16 - 6) & MASK_BCD) | 0x10 : (n) - 16)
 
-  bool overflow = ((acc ^ subtrahend_inverted & MASK_COMPLEMENT) == 0)
-                  && (((acc ^ result) & MASK_COMPLEMENT) != 0);
+#define BCD_ROW(f, n)                                                         \
+  f (n), f (n + 1), f (n + 2), f (n + 3), f (n + 4), f (n + 5), f (n + 6),    \
+      f (n + 7)
 
-  cpu_flag_set_if ('C', sum9 > UCHAR_MAX);
-  cpu_flag_set_if ('V', overflow);
-  cpu_flag_toggle_zn (result);
+static const uint8_t BCD_ADJUST_ADD[32] = {
+  BCD_ROW (BCD_ADD, 0),
+  BCD_ROW (BCD_ADD, 8),
+  BCD_ROW (BCD_ADD, 16),
+  BCD_ROW (BCD_ADD, 24),
+};
+
+static const uint8_t BCD_ADJUST_SUB[32] = {
+  BCD_ROW (BCD_SUB, 0),
+  BCD_ROW (BCD_SUB, 8),
+  BCD_ROW (BCD_SUB, 16),
+  BCD_ROW (BCD_SUB, 24),
+};
+
+#undef BCD_ADD
+#undef BCD_SUB
+#undef BCD_ROW
+
+// V comes from the binary sum, N and Z from the BCD result
+
+static void
+cpu_helper_adc_decimal (uint8_t addend)
+{
+  uint8_t acc = CPU.ACC;
+  uint8_t carry_in = FLAGS.C;
+  uint8_t bin_res = acc + addend + carry_in;
+
+  uint8_t lo = BCD_ADJUST_ADD[(acc & MASK_BCD) + (addend & MASK_BCD)
+                              + carry_in];
+  uint8_t hi = BCD_ADJUST_ADD[(acc >> 4) + (addend >> 4) + (lo >> 4)];
+  uint8_t result = (hi << 4) | (lo & MASK_BCD);
+
+  FLAGS.C = hi >> 4;
+  FLAGS.V = (((acc ^ bin_res) & (addend ^ bin_res)) >> 7) & 1;
+  cpu_flag_set_nz (result);
 
   CPU.ACC = result;
 }
@@ -737,60 +1396,70 @@ cpu_helper_sbc_binary (uint8_t subtrahend)
 static void
 cpu_helper_sbc_decimal (uint8_t subtrahend)
 {
-  int carry_in = cpu_flag_is_set ('C') ? 1 : 0;
   uint8_t acc = CPU.ACC;
+  uint8_t borrow = FLAGS.C ^ 1;
+  uint8_t bin_res = acc - subtrahend - borrow;
 
-  int16_t bin_diff = acc - subtrahend - (1 - carry_in);
-  uint8_t bin_res = bin_diff & MASK_BYTE;
+  uint8_t lo = BCD_ADJUST_SUB[(acc & MASK_BCD) - (subtrahend & MASK_BCD)
+                              - borrow + 16];
+  uint8_t hi = BCD_ADJUST_SUB[(acc >> 4) - (subtrahend >> 4) - (lo >> 4)
+                              + 16];
+  uint8_t result = (hi << 4) | (lo & MASK_BCD);
 
-  bool overflow = (((acc ^ subtrahend) & MASK_COMPLEMENT) != 0)
-                  && (((acc ^ bin_res) & MASK_COMPLEMENT) != 0);
+  FLAGS.C = (hi >> 4) ^ 1;
+  FLAGS.V = (((acc ^ subtrahend) & (acc ^ bin_res)) >> 7) & 1;
+  cpu_flag_set_nz (result);
 
-  uint8_t acc_lo = acc & MASK_BCD;
-  uint8_t sub_hi = subtrahend & MASK_BCD;
-  int8_t borrow = (1 - carry_in);
+  CPU.ACC = result;
+}
 
-  int8_t lo = acc_lo - sub_lo - borrow;
-  int8_t adj_lo = 0;
+#endif
 
-  if (lo < 0)
-    lo -= 6;
+// Execution Helpers
 
-  int8_t hi = (acc << 4) - (subtrahend >> 4) - (lo < 0);
-  bool carry_out = true;
+static uint8_t
+cpu_helper_rmw (rmwutil_fn_t op)
+{
+  if (ADDR.mode == ADDRMODE_ACC)
+    return CPU.ACC = op (CPU.ACC);
 
-  if (hi < 0)
-    {
-      hi -= 6;
-      carry_out = false;
-    }
+  uint8_t new = op (ADDR.fetched);
+  cpu_mem_write_rmw (ADDR.eff_addr, ADDR.fetched, new);
+  return new;
+}
 
-  uint8_t result = ((hi << 4) | (lo & MASK_BCD)) & MASK_BYTE;
+// Read-Modify-Write Utilities
 
-  cpu_flag_set_if ('C', carry_out);
-  cpu_flag_set_if ('V', overflow);
-  cpu_flag_toggle_zn (result);
+static uint8_t
+cpu_rmwutil_asl (uint8_t val)
+{
+  return (val << 1) & MASK_BYTE;
+}
 
-  CPU.ACC = result;
+static uint8_t
+cpu_rmwutil_lsr (uint8_t val)
+{
+  return val >> 1;
 }
 
-// Execution Helpers
+static uint8_t
+cpu_rmwutil_rol (uint8_t val)
+{
+  return ((val << 1) | FLAGS.C) & MASK_BYTE;
+}
 
 static uint8_t
-cpu_helper_rmw (rmwutil_fn_t op)
+cpu_rmwutil_ror (uint8_t val)
 {
-  uint8_t val = cpu_mem_read_byte (ADDR.eff_addr);
-  uint8_t new = op (val);
-  cpu_mem_write_byte (ADDR.eff_addr, new);
-  return new;
+  return (val >> 1) | (FLAGS.C << 7);
 }
 
-static bool
+static void
 cpu_helper_cmp (uint8_t reg_val, uint8_t operand)
 {
   int16_t diff = (reg_val - operand) & MASK_DIFF;
-  cpu_flag_set_if ('C', reg_val >= operand);
-  cpu_flag_toggle_zn ((uint8_t)(diff & MASK_BYTE));
+  FLAGS.C = reg_val >= operand;
+  cpu_flag_set_nz ((uint8_t)(diff & MASK_BYTE));
 }
 
 static void
@@ -798,6 +1467,7 @@ cpu_helper_branch (bool cond)
 {
   if (!cond)
     return;
+  ADDR.page_crossed = GET_PAGE (CPU.PC) != GET_PAGE (OPERAND.word);
   CPU.PC = OPERAND.word;
   if (ADDR.page_crossed)
     CPU.total_cycles += 2;
@@ -814,9 +1484,9 @@ cpu_handle_nmi (void)
     return;
 
   CPU.pending_NMI = false;
-  cpu_state_save_pc ();
-  cpu_state_save_flags ();
-  cpu_flag_set ('I');
+  cpu_status_save_pc ();
+  cpu_status_save_flags ();
+  FLAGS.I = 1;
   CPU.PC = cpu_mem_read_word (VECADDR_NMI);
   CPU.total_cycles += 7;
 }
@@ -828,38 +1498,574 @@ cpu_handle_reset (void)
     return;
 
   CPU.pending_RESET = false;
-  cpu_flag_set ('I');
+  FLAGS.I = 1;
   CPU.PC = cpu_mem_read_word (VECADDR_RESET);
   CPU.total_cycles += 7;
   CPU.SP -= 3;
 }
 
+// IRQ is a wired-OR line: each source (CPU_IRQ_MAPPER, ...) holds its
+// bit in `irq_lines' until it is acknowledged at that source, and the
+// CPU keeps taking the IRQ while any bit is set and I is clear. One
+// source letting go leaves the others asserted.
+
+void
+cpu_irq_set (uint8_t source, bool asserted)
+{
+  if (asserted)
+    CPU.irq_lines |= source;
+  else
+    CPU.irq_lines &= ~source;
+  CPU.pending_IRQ = CPU.irq_lines != 0;
+}
+
 static void
 cpu_handle_irq (void)
 {
   if (!CPU.pending_IRQ)
     return;
 
-  CPU.pending_IRQ = false;
-  cpu_state_save_pc ();
-  cpu_state_save_flags ();
-  cpu_flag_set ('I');
+  cpu_status_save_pc ();
+  cpu_status_save_flags ();
+  FLAGS.I = 1;
   CPU.PC = cpu_mem_read_word (VECADDR_IRQ);
   CPU.total_cycles += 7;
+  CPU.pending_IRQ = CPU.irq_lines != 0;
 }
 
 // The Indirect Threaded Dispatch Table
 
-static void
+#include "6502-itc.h"
+
+static const dispatch_entry_t DISPATCH_TABLE[UCHAR_MAX + 1] = {
+m4_esyscmd(`awk -f itc-dispatch-gen.awk 6502-instrs.tsv')m4_dnl
+};
+
+__attribute__ ((unused)) static const dispatch_info_t
+    DISPATCH_INFO[UCHAR_MAX + 1] = {
+m4_esyscmd(`awk -v emit=info -f itc-dispatch-gen.awk 6502-instrs.tsv')m4_dnl
+};
+
+static inline void
 cpu_dispatch_table (uint8_t opcode)
 {
-  DISPATCH.opcode = opcode;
+  DISPATCH = &DISPATCH_TABLE[opcode];
+}
+
+// Decoded Blocks
+//
+// A block is a run of instructions from one page, decoded once: operand
+// bytes read, branch targets resolved and the worst-case cycle count
+// summed. It ends after a branch, jump, call, return or BRK, at the end
+// of the page, or after BLOCK_MAX_INSTRS. Blocks live in a direct-mapped
+// cache indexed by PC and are tagged with the bytes the page mapped when
+// they were decoded, so a bank switch misses without being told, and
+// with the page's write count, so code in RAM that gets overwritten is
+// decoded again. Traps, instructions straddling the page end and code in
+// MMIO are left to cpu_step. Whoever changes memory behind the bus
+// (loading a state, poking a ROM image) calls cpu_block_flush.
+
+void
+cpu_block_flush (void)
+{
+  memset (BLOCKS, 0, sizeof (BLOCKS));
+}
+
+static bool
+cpu_block_ends (const dispatch_entry_t *entry)
+{
+  return entry->resolver_fn == cpu_addrmode_rel
+         || entry->itc_fn == cpu_itc_jmp || entry->itc_fn == cpu_itc_jsr
+         || entry->itc_fn == cpu_itc_rts || entry->itc_fn == cpu_itc_rti
+         || entry->itc_fn == cpu_itc_brk;
+}
+
+// Whether an instruction only reads: a load, compare, BIT, logic op,
+// transfer or flag change with an operand that names a fixed address.
+// A loop made of these and a branch back cannot change memory, and
+// once it has come round with its registers unchanged it never will.
+
+static bool
+cpu_block_reads_only (const dispatch_entry_t *entry)
+{
+  resolver_fn_t mode = entry->resolver_fn;
+  itc_fn_t op = entry->itc_fn;
+
+  if (mode != cpu_addrmode_impl && mode != cpu_addrmode_imm
+      && mode != cpu_addrmode_zpg && mode != cpu_addrmode_abs)
+    return false;
+
+  return op == cpu_itc_lda || op == cpu_itc_ldx || op == cpu_itc_ldy
+         || op == cpu_itc_bit || op == cpu_itc_cmp || op == cpu_itc_cpx
+         || op == cpu_itc_cpy || op == cpu_itc_and || op == cpu_itc_ora
+         || op == cpu_itc_eor || op == cpu_itc_tax || op == cpu_itc_tay
+         || op == cpu_itc_txa || op == cpu_itc_tya || op == cpu_itc_clc
+         || op == cpu_itc_sec || op == cpu_itc_clv || op == cpu_itc_nop;
+}
+
+static bool
+cpu_block_idle (const cpu_block_t *blk)
+{
+  if (blk->count == 0)
+    return false;
+
+  const cpu_decoded_t *last = &blk->instrs[blk->count - 1];
+  const dispatch_entry_t *entry = &DISPATCH_TABLE[last->opcode];
+  bool loops = entry->resolver_fn == cpu_addrmode_rel
+               || (entry->itc_fn == cpu_itc_jmp
+                   && entry->resolver_fn == cpu_addrmode_abs_ea);
+
+  if (!loops || last->operand != blk->pc)
+    return false;
+
+  for (int i = 0; i < blk->count - 1; i++)
+    if (!cpu_block_reads_only (&DISPATCH_TABLE[blk->instrs[i].opcode]))
+      return false;
+  return true;
+}
+
+static void
+cpu_block_decode (cpu_block_t *blk, uint16_t pc, const uint8_t *bytes)
+{
+  uint8_t page = GET_PAGE (pc);
+
+  blk->bytes = bytes;
+  blk->home_page = MEMORY.home_page[page];
+  blk->writes = MEMORY.writes[blk->home_page];
+  blk->pc = pc;
+  blk->count = 0;
+  blk->max_cycles = 0;
+
+  while (blk->count < BLOCK_MAX_INSTRS)
+    {
+      unsigned offset = pc & MASK_BYTE;
+      const dispatch_entry_t *entry = &DISPATCH_TABLE[bytes[offset]];
+
+      if (entry->itc_fn == cpu_itc_trap
+          || offset + entry->size_bytes > PAGE_SIZE)
+        break;
+
+      cpu_decoded_t *in = &blk->instrs[blk->count++];
+      in->opcode = entry->opcode;
+      in->next_pc = pc + entry->size_bytes;
+      in->operand = 0;
+      if (entry->size_bytes > 1)
+        in->operand = bytes[offset + 1];
+      if (entry->size_bytes > 2)
+        in->operand |= bytes[offset + 2] << 8;
+      if (entry->resolver_fn == cpu_addrmode_rel)
+        in->operand = in->next_pc + (int8_t)in->operand;
+
+      blk->max_cycles += entry->num_cycles;
+      if (entry->special_case == SPECIALCASE_PAGE_CROSS)
+        blk->max_cycles += 1;
+      else if (entry->special_case == SPECIALCASE_BRANCH_CROSS)
+        blk->max_cycles += 2;
+
+      pc = in->next_pc;
+      if (cpu_block_ends (entry) || GET_PAGE (pc) != page)
+        break;
+    }
+
+  blk->idle = cpu_block_idle (blk);
+}
+
+static inline const cpu_block_t *
+cpu_block_lookup (uint16_t pc)
+{
+  const uint8_t *bytes = MEMORY.read_page[GET_PAGE (pc)];
+  cpu_block_t *blk = &BLOCKS[pc & (BLOCK_CACHE_SIZE - 1)];
+
+  if (bytes == NULL)
+    return NULL;
+  if (blk->pc != pc || blk->bytes != bytes
+      || blk->writes != MEMORY.writes[blk->home_page])
+    cpu_block_decode (blk, pc, bytes);
+  return blk;
+}
+
+// CPU Lifecycle
+
+__attribute__ ((unused)) static void
+cpu_init (void)
+{
+#ifdef CPU_PROFILE
+  if (PROFILE.cycles == NULL && !cpu_profile_rom (NULL, 0))
+    {
+      fprintf (stderr, "cpu_init: out of memory for the profile\n");
+      abort ();
+    }
+#endif
+  memset (&CPU, 0, sizeof (CPU));
+  memset (&FLAGS, 0, sizeof (FLAGS));
+  cpu_mem_map (0x0000, RAM_END, MEMORY.ram, RAM_SIZE, true);
+  cpu_mem_map_mmio (RAM_END + 1, 0xFFFF, NULL, NULL);
+  cpu_block_flush ();
+  memset (&IDLE, 0, sizeof (IDLE));
+  IDLE.enabled = true;
+  CPU.SP = 0xFD;
+  CPU.running = true;
+  CPU.pending_RESET = true;
+  FLAGS.I = 1;
+}
+
+// Execution Helpers -- Shared by All Cores
+
+static inline void
+cpu_handle_interrupts (void)
+{
+  cpu_handle_reset ();
+  cpu_handle_nmi ();
+  if (!FLAGS.I)
+    cpu_handle_irq ();
+}
+
+__attribute__ ((always_inline)) static inline void
+cpu_operand_latch (void)
+{
+  OPERAND.byte = ADDR.fetched;
+  OPERAND.word = ADDR.eff_addr;
+}
+
+// The Indirect Threaded Core
+//
+// One descriptor load per instruction, then one call through
+// `resolver_fn' and one through `itc_fn'. Always built, and the only
+// core available when CPU_NO_DIRECT_THREADING is defined. It is also the
+// only one that feeds the profiler, so CPU_PROFILE builds run it.
+
+static inline void
+cpu_step (void)
+{
+  uint64_t entry = CPU.total_cycles;
+
+  if (CPU.pending_RESET | CPU.pending_NMI | CPU.pending_IRQ)
+    cpu_handle_interrupts ();
+
+  uint16_t pc = CPU.PC;
+  uint64_t begin = CPU.total_cycles;
+
+  cpu_dispatch_table (cpu_mem_read_byte (CPU.PC++));
+  DISPATCH->resolver_fn ();
+  cpu_operand_latch ();
+  DISPATCH->itc_fn ();
+
+  CPU.total_cycles += DISPATCH->num_cycles;
+  if (DISPATCH->special_case == SPECIALCASE_PAGE_CROSS)
+    CPU.total_cycles += ADDR.page_crossed;
+  CPU.total_instrs++;
+  cpu_profile_count (pc, begin - entry, CPU.total_cycles - begin);
+}
+
+__attribute__ ((unused)) static void
+cpu_run_indirect (uint64_t cycle_limit)
+{
+  while (CPU.running && CPU.total_cycles < cycle_limit)
+    cpu_step ();
+}
+
+// The Direct Threaded Core
+//
+// Every opcode gets its own handler with the addressing mode and the
+// operation fused into it, so the compiler can inline both and no call
+// is made through a function pointer. With GCC/Clang each handler jumps
+// straight to the next opcode's label (labels-as-values); elsewhere the
+// same handlers are cases of a portable `switch'.
+
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+#define CPU_COMPUTED_GOTO
+#endif
+
+#define DTC_FETCH()                                                           \
+  do                                                                          \
+    {                                                                         \
+      if (!CPU.running || CPU.total_cycles >= cycle_limit)                    \
+        return;                                                               \
+      if (CPU.pending_RESET | CPU.pending_NMI | CPU.pending_IRQ)              \
+        cpu_handle_interrupts ();                                             \
+      opcode = cpu_mem_read_byte (CPU.PC++);                                  \
+    }                                                                         \
+  while (0)
+
+#ifdef CPU_COMPUTED_GOTO
+#define DTC_HANDLER(op) dtc_##op:
+#define DTC_NEXT()                                                            \
+  do                                                                          \
+    {                                                                         \
+      DTC_FETCH ();                                                           \
+      goto *DTC_LABELS[opcode];                                               \
+    }                                                                         \
+  while (0)
+#else
+#define DTC_HANDLER(op) case op:
+#define DTC_NEXT() continue
+#endif
+
+__attribute__ ((unused)) static void
+cpu_run_direct (uint64_t cycle_limit)
+{
+  uint8_t opcode;
+
+#ifdef CPU_COMPUTED_GOTO
+  static void *const DTC_LABELS[UCHAR_MAX + 1] = {
+m4_esyscmd(`awk -v emit=labels -f itc-dispatch-gen.awk 6502-instrs.tsv')m4_dnl
+  };
+
+  DTC_NEXT ();
+  {
+#else
+  for (;;)
+    {
+      DTC_FETCH ();
+
+      switch (opcode)
+        {
+#endif
+m4_esyscmd(`awk -v emit=handlers -f itc-dispatch-gen.awk 6502-instrs.tsv')m4_dnl
+#ifndef CPU_COMPUTED_GOTO
+        }
+#endif
+    }
+}
+
+#undef DTC_FETCH
+#undef DTC_HANDLER
+#undef DTC_NEXT
+
+// Idle Loops
+//
+// A block marked idle that arrives back at its start with registers and
+// flags as it left them, one iteration after it last did, will go on
+// doing so for as long as what it reads holds still, because it writes
+// nothing. Memory only changes under CPU writes, and an MMIO register's
+// stable_fn says how long it holds, so the loop is run forward in whole
+// iterations to the cycle limit or the first register change. Skipped
+// cycles and instructions are counted as executed, which leaves the
+// machine exactly where running the loop would have.
+
+void
+cpu_idle_skip_enable (bool enabled)
+{
+  IDLE.enabled = enabled;
+  IDLE.block = NULL;
+}
+
+cpu_idle_stats_t
+cpu_idle_stats_take (void)
+{
+  cpu_idle_stats_t stats = IDLE.stats;
+  memset (&IDLE.stats, 0, sizeof (IDLE.stats));
+  return stats;
+}
 
-  switch (DISPATCH.opcode)
+static uint64_t
+cpu_idle_horizon (const cpu_block_t *blk)
+{
+  uint64_t horizon = UINT64_MAX;
+
+  for (int i = 0; i < blk->count; i++)
     {
-        m4_esyscmd(`cat 6502-instrs.tsv | awk -f itc-dispatch-gen.awk')m4_dnl
+      const dispatch_entry_t *entry = &DISPATCH_TABLE[blk->instrs[i].opcode];
+      uint16_t addr = blk->instrs[i].operand;
+      uint8_t page = GET_PAGE (addr);
+
+      if (entry->resolver_fn != cpu_addrmode_zpg
+          && entry->resolver_fn != cpu_addrmode_abs)
+        continue;
+      if (MEMORY.read_page[page] != NULL)
+        continue;
+      if (MEMORY.stable_fn[page] == NULL)
+        return 0;
+
+      uint64_t until = MEMORY.stable_fn[page](addr);
+      if (until < horizon)
+        horizon = until;
+    }
 
-	default:
-	   return;
+  return horizon;
+}
+
+static bool
+cpu_idle_skip (const cpu_block_t *blk, uint64_t cycle_limit)
+{
+  bool repeated = IDLE.block == blk
+                  && CPU.total_instrs - IDLE.regs.total_instrs == blk->count
+                  && CPU.ACC == IDLE.regs.ACC && CPU.XR == IDLE.regs.XR
+                  && CPU.YR == IDLE.regs.YR && CPU.SP == IDLE.regs.SP
+                  && memcmp (&FLAGS, &IDLE.flags, sizeof (FLAGS)) == 0;
+  uint64_t skipped = 0;
+
+  if (repeated)
+    {
+      uint64_t period = CPU.total_cycles - IDLE.regs.total_cycles;
+      uint64_t until = cpu_idle_horizon (blk);
+
+      if (until > cycle_limit)
+        until = cycle_limit;
+      if (until > CPU.total_cycles)
+        skipped = (until - CPU.total_cycles) / period;
+
+      CPU.total_cycles += skipped * period;
+      CPU.total_instrs += skipped * blk->count;
+      IDLE.stats.loops += skipped != 0;
+      IDLE.stats.cycles += skipped * period;
+      IDLE.stats.instrs += skipped * blk->count;
     }
+
+  IDLE.block = blk;
+  IDLE.regs = CPU;
+  IDLE.flags = FLAGS;
+  return skipped != 0;
+}
+
+// The Decoded Block Core
+//
+// Handlers are fused like the direct threaded core's, but run over the
+// instructions of a cached block, so no opcode or operand is fetched
+// through the bus. Interrupts and the cycle limit are looked at when a
+// block is entered: it is run only if its worst case fits under the
+// limit, and otherwise the instruction goes through cpu_step, so that
+// this core stops on the same instruction as the others. An interrupt
+// raised, or a write to the block's own page, ends the block early.
+// Entering an idle block right after running it through is where idle
+// loops are caught.
+
+#define BLK_ENTER()                                                           \
+  do                                                                          \
+    {                                                                         \
+      for (;;)                                                                \
+        {                                                                     \
+          if (!CPU.running || CPU.total_cycles >= cycle_limit)                \
+            return;                                                           \
+          if (CPU.pending_RESET | CPU.pending_NMI | CPU.pending_IRQ)          \
+            cpu_handle_interrupts ();                                         \
+          if (blk != NULL && blk->idle && in == end && CPU.PC == blk->pc      \
+              && IDLE.enabled && cpu_idle_skip (blk, cycle_limit))            \
+            continue;                                                         \
+          blk = cpu_block_lookup (CPU.PC);                                    \
+          if (blk != NULL && blk->count != 0                                  \
+              && CPU.total_cycles + blk->max_cycles <= cycle_limit)           \
+            break;                                                            \
+          blk = NULL;                                                         \
+          cpu_step ();                                                        \
+        }                                                                     \
+      in = blk->instrs;                                                       \
+      end = in + blk->count;                                                  \
+    }                                                                         \
+  while (0)
+
+#define BLK_STAY()                                                            \
+  (++in != end && CPU.running                                                 \
+   && !(CPU.pending_RESET | CPU.pending_NMI | CPU.pending_IRQ)                \
+   && MEMORY.writes[blk->home_page] == blk->writes)
+
+#ifdef CPU_COMPUTED_GOTO
+#define BLK_HANDLER(op) blk_##op:
+#define BLK_DISPATCH()                                                        \
+  do                                                                          \
+    {                                                                         \
+      CPU.PC = in->next_pc;                                                   \
+      goto *BLK_LABELS[in->opcode];                                           \
+    }                                                                         \
+  while (0)
+#define BLK_NEXT()                                                            \
+  do                                                                          \
+    {                                                                         \
+      if (!BLK_STAY ())                                                       \
+        goto enter;                                                           \
+      BLK_DISPATCH ();                                                        \
+    }                                                                         \
+  while (0)
+#else
+#define BLK_HANDLER(op) case op:
+#define BLK_NEXT() break
+#endif
+
+__attribute__ ((unused)) static void
+cpu_run_block (uint64_t cycle_limit)
+{
+  const cpu_block_t *blk = NULL;
+  const cpu_decoded_t *in = NULL, *end = NULL;
+
+#ifdef CPU_COMPUTED_GOTO
+  static void *const BLK_LABELS[UCHAR_MAX + 1] = {
+m4_esyscmd(`awk -v emit=block_labels -f itc-dispatch-gen.awk 6502-instrs.tsv')m4_dnl
+  };
+
+enter:
+  BLK_ENTER ();
+  BLK_DISPATCH ();
+  {
+#else
+  for (;;)
+    {
+      BLK_ENTER ();
+
+      do
+        {
+          CPU.PC = in->next_pc;
+          switch (in->opcode)
+            {
+#endif
+m4_esyscmd(`awk -v emit=block_handlers -f itc-dispatch-gen.awk 6502-instrs.tsv')m4_dnl
+#ifndef CPU_COMPUTED_GOTO
+            }
+        }
+      while (BLK_STAY ());
+#endif
+    }
+}
+
+#undef BLK_ENTER
+#undef BLK_STAY
+#undef BLK_HANDLER
+#undef BLK_DISPATCH
+#undef BLK_NEXT
+
+// Run Control
+//
+// The emulator runs the CPU in stretches: cpu_run goes through the
+// fastest core built in, skipping idle loops, and returns on the first
+// instruction boundary at or past `cycle_limit'. A register handler that
+// finds the stretch must end sooner, because an event it is timed
+// against moved earlier or a DMA started, calls cpu_run_end, and
+// cpu_run returns after the instruction making the access. cpu_stall
+// charges cycles the CPU spends halted.
+
+void
+cpu_run (uint64_t cycle_limit)
+{
+#if defined(CPU_NO_DIRECT_THREADING) || defined(CPU_PROFILE)
+  cpu_run_indirect (cycle_limit);
+#elif defined(CPU_NO_BLOCK_CACHE)
+  cpu_run_direct (cycle_limit);
+#else
+  cpu_run_block (cycle_limit);
+#endif
+  if (CPU.run_ended)
+    {
+      CPU.run_ended = false;
+      CPU.running = true;
+    }
+}
+
+void
+cpu_run_end (void)
+{
+  if (!CPU.running)
+    return;
+  CPU.running = false;
+  CPU.run_ended = true;
+}
+
+void
+cpu_stall (uint64_t cycles)
+{
+  CPU.total_cycles += cycles;
+}
+
+uint64_t
+cpu_cycles (void)
+{
+  return CPU.total_cycles;
 }
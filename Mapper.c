@@ -0,0 +1,545 @@
+// Mapper.c -- Cartridge mappers
+//
+// A mapper declares how large its PRG and CHR bank windows are and
+// handles writes to its registers; the framework does the rest. A bank
+// switch points the CPU's page table (cpu_mem_map) and the PPU's CHR
+// windows (ppu_chr_map) at the bytes the bank selects, so a read from
+// cartridge space costs the same pointer add as a read from RAM and
+// never calls into the mapper. The mapper only runs on a register
+// write and, for mappers with an IRQ counter, when the scheduler's
+// event for that counter comes due: the counter tells how many clocks
+// it has left (mapper_irq_clocks), the scheduler turns that into a
+// timestamp, and clocks the counter in one go when it gets there
+// (mapper_clock) instead of calling into the mapper every PPU dot.
+//
+// Mapping goes through CPU.c's page table, so this file is built in the
+// same translation unit, after it (see mapper-bench.c).
+
+#define MAPPER_PRG_BEGIN 0x8000
+#define MAPPER_PRG_RAM_BEGIN 0x6000
+#define MAPPER_PRG_RAM_SIZE 0x2000
+#define MAPPER_CHR_WINDOW 0x0400
+#define MAPPER_CHR_WINDOWS 8
+
+// Shared with PPU.c
+#define PPU_MIRROR_HORIZONTAL 0
+#define PPU_MIRROR_VERTICAL 1
+#define PPU_MIRROR_SINGLE_A 2
+#define PPU_MIRROR_SINGLE_B 3
+#define PPU_MIRROR_FOUR_SCREEN 4
+
+void ppu_chr_map (int window, uint8_t *bytes, int bank);
+bool ppu_chr_rom (const uint8_t *chr, size_t size);
+void ppu_mirroring_set (int mode);
+
+typedef struct mapper mapper_t;
+
+typedef struct
+{
+  const char *name;
+  uint16_t id;
+  uint16_t prg_window;
+  uint16_t chr_window;
+  void (*reset) (mapper_t *);
+  void (*write) (mapper_t *, uint16_t, uint8_t);
+  void (*clock) (mapper_t *, int);
+  int (*irq_clocks) (mapper_t *);
+} mapper_ops_t;
+
+typedef struct
+{
+  uint8_t shift;
+  uint8_t count;
+  uint8_t control;
+  uint8_t chr0;
+  uint8_t chr1;
+  uint8_t prg;
+  uint64_t last_write;
+} mapper_mmc1_t;
+
+typedef struct
+{
+  uint8_t select;
+  uint8_t bank[8];
+  uint8_t irq_latch;
+  uint8_t irq_counter;
+  bool irq_reload;
+  bool irq_enbl;
+} mapper_mmc3_t;
+
+struct mapper
+{
+  const mapper_ops_t *ops;
+  uint8_t *prg;
+  uint32_t prg_size;
+  uint8_t *chr;
+  uint32_t chr_size;
+  // From the header: horizontal, vertical or four-screen
+  int mirroring;
+  uint8_t prg_ram[MAPPER_PRG_RAM_SIZE];
+  union
+  {
+    uint8_t latch;
+    mapper_mmc1_t mmc1;
+    mapper_mmc3_t mmc3;
+  } regs;
+};
+
+// The mapper whose registers the cartridge pages' write handler reaches.
+// Selected along with the CPU and PPU contexts of the same machine.
+
+static _Thread_local mapper_t *MAPPER_CURRENT;
+
+void
+mapper_select (mapper_t *mapper)
+{
+  MAPPER_CURRENT = mapper;
+}
+
+static void
+mapper_cpu_write (uint16_t addr, uint8_t val)
+{
+  MAPPER_CURRENT->ops->write (MAPPER_CURRENT, addr, val);
+}
+
+// Mirroring
+//
+// Boards without mirroring control keep the header's layout, which
+// mapper_reset sets. A four-screen board wires its own nametable RAM
+// and ignores the mapper's control, so mappers set mirroring through
+// here.
+
+static void
+mapper_mirroring_set (mapper_t *m, int mode)
+{
+  if (m->mirroring != PPU_MIRROR_FOUR_SCREEN)
+    ppu_mirroring_set (mode);
+}
+
+// Bank Switching
+//
+// `slot' counts windows from $8000 (PRG) or $0000 (CHR) in units of the
+// mapper's window size, and `bank' counts banks of that size. Banks
+// wrap around the ROM, and negative ones count back from its end, which
+// is how mappers name their fixed last bank.
+
+static void
+mapper_prg_switch (mapper_t *m, int slot, int bank)
+{
+  uint32_t size = m->ops->prg_window;
+  uint16_t begin = MAPPER_PRG_BEGIN + slot * size;
+  uint16_t end = begin + size - 1;
+  int banks = m->prg_size > size ? m->prg_size / size : 1;
+
+  bank %= banks;
+  if (bank < 0)
+    bank += banks;
+
+  // A ROM smaller than the window is mirrored across it
+  cpu_mem_map (begin, end, m->prg + bank * size,
+               m->prg_size < size ? m->prg_size : size, false);
+  cpu_mem_map_rom_writes (begin, end, mapper_cpu_write);
+}
+
+static void
+mapper_chr_switch (mapper_t *m, int slot, int bank)
+{
+  uint32_t size = m->ops->chr_window;
+  int windows = size / MAPPER_CHR_WINDOW;
+  int banks = m->chr_size > size ? m->chr_size / size : 1;
+
+  bank %= banks;
+  if (bank < 0)
+    bank += banks;
+
+  for (int i = 0; i < windows; i++)
+    {
+      int window = slot * windows + i;
+      uint32_t offset = bank * size + i * MAPPER_CHR_WINDOW;
+
+      if (m->chr == NULL)
+        ppu_chr_map (window, NULL, window);
+      else
+        ppu_chr_map (window, m->chr + offset % m->chr_size,
+                     offset % m->chr_size / MAPPER_CHR_WINDOW);
+    }
+}
+
+// NROM (0) -- No banking
+
+static void
+mapper_nrom_reset (mapper_t *m)
+{
+  mapper_prg_switch (m, 0, 0);
+  mapper_chr_switch (m, 0, 0);
+}
+
+static void
+mapper_nrom_write (mapper_t *m, uint16_t addr, uint8_t val)
+{
+  (void)m;
+  (void)addr;
+  (void)val;
+}
+
+// MMC1 (1) -- Five-write serial port into four registers
+
+static void
+mapper_mmc1_update (mapper_t *m)
+{
+  static const int MIRRORING[4] = { PPU_MIRROR_SINGLE_A, PPU_MIRROR_SINGLE_B,
+                                    PPU_MIRROR_VERTICAL,
+                                    PPU_MIRROR_HORIZONTAL };
+  mapper_mmc1_t *r = &m->regs.mmc1;
+  uint8_t prg = r->prg & 0x0F;
+
+  mapper_mirroring_set (m, MIRRORING[r->control & 0x03]);
+
+  switch ((r->control >> 2) & 0x03)
+    {
+    case 0:
+    case 1:
+      mapper_prg_switch (m, 0, prg & ~1);
+      mapper_prg_switch (m, 1, prg | 1);
+      break;
+    case 2:
+      mapper_prg_switch (m, 0, 0);
+      mapper_prg_switch (m, 1, prg);
+      break;
+    case 3:
+      mapper_prg_switch (m, 0, prg);
+      mapper_prg_switch (m, 1, -1);
+      break;
+    }
+
+  if (r->control & 0x10)
+    {
+      mapper_chr_switch (m, 0, r->chr0);
+      mapper_chr_switch (m, 1, r->chr1);
+    }
+  else
+    {
+      mapper_chr_switch (m, 0, r->chr0 & ~1);
+      mapper_chr_switch (m, 1, r->chr0 | 1);
+    }
+}
+
+static void
+mapper_mmc1_reset (mapper_t *m)
+{
+  memset (&m->regs.mmc1, 0, sizeof (m->regs.mmc1));
+  m->regs.mmc1.control = 0x0C;
+  m->regs.mmc1.last_write = UINT64_MAX;
+  mapper_mmc1_update (m);
+}
+
+// A read-modify-write instruction writes twice on consecutive cycles,
+// and the chip ignores the second: INC of a ROM byte of $80 or more
+// resets the shift register, which some games rely on.
+
+static void
+mapper_mmc1_write (mapper_t *m, uint16_t addr, uint8_t val)
+{
+  mapper_mmc1_t *r = &m->regs.mmc1;
+
+  if (r->last_write == CPU.total_cycles)
+    return;
+  r->last_write = CPU.total_cycles;
+
+  if (val & 0x80)
+    {
+      r->shift = r->count = 0;
+      r->control |= 0x0C;
+      mapper_mmc1_update (m);
+      return;
+    }
+
+  r->shift |= (val & 1) << r->count;
+  if (++r->count < 5)
+    return;
+
+  switch ((addr >> 13) & 0x03)
+    {
+    case 0:
+      r->control = r->shift;
+      break;
+    case 1:
+      r->chr0 = r->shift;
+      break;
+    case 2:
+      r->chr1 = r->shift;
+      break;
+    case 3:
+      r->prg = r->shift;
+      break;
+    }
+  r->shift = r->count = 0;
+  mapper_mmc1_update (m);
+}
+
+// UxROM (2) -- Switchable 16 KiB at $8000, last bank fixed at $C000
+
+static void
+mapper_uxrom_reset (mapper_t *m)
+{
+  mapper_prg_switch (m, 0, 0);
+  mapper_prg_switch (m, 1, -1);
+  mapper_chr_switch (m, 0, 0);
+}
+
+static void
+mapper_uxrom_write (mapper_t *m, uint16_t addr, uint8_t val)
+{
+  (void)addr;
+  m->regs.latch = val;
+  mapper_prg_switch (m, 0, val);
+}
+
+// CNROM (3) -- Switchable 8 KiB of CHR
+
+static void
+mapper_cnrom_write (mapper_t *m, uint16_t addr, uint8_t val)
+{
+  (void)addr;
+  m->regs.latch = val;
+  mapper_chr_switch (m, 0, val);
+}
+
+// AxROM (7) -- Switchable 32 KiB, one-screen mirroring
+
+static void
+mapper_axrom_write (mapper_t *m, uint16_t addr, uint8_t val)
+{
+  (void)addr;
+  m->regs.latch = val;
+  mapper_prg_switch (m, 0, val & 0x07);
+  mapper_mirroring_set (m, val & 0x10 ? PPU_MIRROR_SINGLE_B
+                                       : PPU_MIRROR_SINGLE_A);
+}
+
+static void
+mapper_axrom_reset (mapper_t *m)
+{
+  mapper_axrom_write (m, MAPPER_PRG_BEGIN, 0);
+  mapper_chr_switch (m, 0, 0);
+}
+
+// MMC3 (4) -- Eight bank registers, scanline IRQ counter
+
+static void
+mapper_mmc3_update (mapper_t *m)
+{
+  mapper_mmc3_t *r = &m->regs.mmc3;
+  int prg_swap = (r->select & 0x40) ? 2 : 0;
+  int chr_swap = (r->select & 0x80) ? 4 : 0;
+
+  mapper_prg_switch (m, 0 ^ prg_swap, r->bank[6]);
+  mapper_prg_switch (m, 1, r->bank[7]);
+  mapper_prg_switch (m, 2 ^ prg_swap, -2);
+  mapper_prg_switch (m, 3, -1);
+
+  mapper_chr_switch (m, 0 ^ chr_swap, r->bank[0] & ~1);
+  mapper_chr_switch (m, 1 ^ chr_swap, r->bank[0] | 1);
+  mapper_chr_switch (m, 2 ^ chr_swap, r->bank[1] & ~1);
+  mapper_chr_switch (m, 3 ^ chr_swap, r->bank[1] | 1);
+  for (int i = 0; i < 4; i++)
+    mapper_chr_switch (m, (4 + i) ^ chr_swap, r->bank[2 + i]);
+}
+
+static void
+mapper_mmc3_reset (mapper_t *m)
+{
+  memset (&m->regs.mmc3, 0, sizeof (m->regs.mmc3));
+  mapper_mmc3_update (m);
+}
+
+static void
+mapper_mmc3_write (mapper_t *m, uint16_t addr, uint8_t val)
+{
+  mapper_mmc3_t *r = &m->regs.mmc3;
+
+  switch (addr & 0xE001)
+    {
+    case 0x8000:
+      r->select = val;
+      mapper_mmc3_update (m);
+      break;
+    case 0x8001:
+      r->bank[r->select & 0x07] = val;
+      mapper_mmc3_update (m);
+      break;
+    case 0xA000:
+      mapper_mirroring_set (m, val & 1 ? PPU_MIRROR_HORIZONTAL
+                                       : PPU_MIRROR_VERTICAL);
+      break;
+    case 0xC000:
+      r->irq_latch = val;
+      break;
+    case 0xC001:
+      r->irq_reload = true;
+      break;
+    case 0xE000:
+      r->irq_enbl = false;
+      cpu_irq_set (CPU_IRQ_MAPPER, false);
+      break;
+    case 0xE001:
+      r->irq_enbl = true;
+      break;
+    }
+}
+
+// Clocked by rising edges of PPU A12, once per rendered line with the
+// usual $0000/$1000 table split. The scheduler never clocks past the
+// edge mapper_mmc3_irq_clocks predicted, so only the last clock of a
+// batch can be the one that raises the IRQ.
+
+static void
+mapper_mmc3_clock (mapper_t *m, int clocks)
+{
+  mapper_mmc3_t *r = &m->regs.mmc3;
+
+  for (; clocks > 0; clocks--)
+    {
+      if (r->irq_counter == 0 || r->irq_reload)
+        {
+          r->irq_counter = r->irq_latch;
+          r->irq_reload = false;
+        }
+      else
+        r->irq_counter--;
+
+      if (r->irq_counter == 0 && r->irq_enbl)
+        cpu_irq_set (CPU_IRQ_MAPPER, true);
+    }
+}
+
+static int
+mapper_mmc3_irq_clocks (mapper_t *m)
+{
+  mapper_mmc3_t *r = &m->regs.mmc3;
+
+  if (!r->irq_enbl)
+    return -1;
+  if (r->irq_counter == 0 || r->irq_reload)
+    return r->irq_latch + 1;
+  return r->irq_counter;
+}
+
+// Mapper Table
+
+static const mapper_ops_t MAPPER_OPS[] = {
+  { "NROM", 0, 0x8000, 0x2000, mapper_nrom_reset, mapper_nrom_write, NULL,
+    NULL },
+  { "MMC1", 1, 0x4000, 0x1000, mapper_mmc1_reset, mapper_mmc1_write, NULL,
+    NULL },
+  { "UxROM", 2, 0x4000, 0x2000, mapper_uxrom_reset, mapper_uxrom_write,
+    NULL, NULL },
+  { "CNROM", 3, 0x8000, 0x2000, mapper_nrom_reset, mapper_cnrom_write,
+    NULL, NULL },
+  { "MMC3", 4, 0x2000, 0x0400, mapper_mmc3_reset, mapper_mmc3_write,
+    mapper_mmc3_clock, mapper_mmc3_irq_clocks },
+  { "AxROM", 7, 0x8000, 0x2000, mapper_axrom_reset, mapper_axrom_write,
+    NULL, NULL },
+};
+
+#define MAPPER_COUNT (sizeof (MAPPER_OPS) / sizeof (MAPPER_OPS[0]))
+
+// Mapper Lifecycle
+//
+// PRG and CHR are borrowed, typically from the shared ROM image, and
+// must outlive the mapper. `chr' is NULL for boards with CHR RAM, which
+// lives in the PPU. `mirroring' is the header's, as mapper_mirroring
+// reads it. Returns NULL for mappers not in the table.
+
+mapper_t *
+mapper_new (uint16_t id, uint8_t *prg, uint32_t prg_size, uint8_t *chr,
+            uint32_t chr_size, int mirroring)
+{
+  for (size_t i = 0; i < MAPPER_COUNT; i++)
+    {
+      if (MAPPER_OPS[i].id != id)
+        continue;
+
+      mapper_t *m = calloc (1, sizeof (mapper_t));
+      if (m == NULL)
+        return NULL;
+      m->ops = &MAPPER_OPS[i];
+      m->prg = prg;
+      m->prg_size = prg_size;
+      m->chr = chr;
+      m->chr_size = chr ? chr_size : 0;
+      m->mirroring = mirroring;
+      return m;
+    }
+  return NULL;
+}
+
+// The nametable layout iNES header byte 6 gives: bit 3 for four-screen
+// RAM on the board, else bit 0 for vertical mirroring.
+
+int
+mapper_mirroring (uint8_t flags6)
+{
+  if (flags6 & 0x08)
+    return PPU_MIRROR_FOUR_SCREEN;
+  return flags6 & 0x01 ? PPU_MIRROR_VERTICAL : PPU_MIRROR_HORIZONTAL;
+}
+
+void
+mapper_free (mapper_t *m)
+{
+  if (MAPPER_CURRENT == m)
+    MAPPER_CURRENT = NULL;
+  free (m);
+}
+
+// Maps the cartridge into the CPU and PPU contexts currently selected
+// and puts the registers in their power-on state. Call after cpu_init
+// and ppu_init, which reset both maps. The PPU is told the CHR ROM, so
+// it decodes each of its tiles once, and given the header's mirroring,
+// which mappers with mirroring control then override. Profiling builds
+// count the PRG per bank from here on.
+
+void
+mapper_reset (mapper_t *m)
+{
+  mapper_select (m);
+#ifdef CPU_PROFILE
+  if (!cpu_profile_rom (m->prg, m->prg_size))
+    fprintf (stderr, "%s: no memory to profile PRG per bank\n", m->ops->name);
+#endif
+  cpu_mem_map (MAPPER_PRG_RAM_BEGIN,
+               MAPPER_PRG_RAM_BEGIN + MAPPER_PRG_RAM_SIZE - 1, m->prg_ram,
+               MAPPER_PRG_RAM_SIZE, true);
+  if (!ppu_chr_rom (m->chr, m->chr_size))
+    fprintf (stderr, "%s: no memory to cache CHR ROM tiles\n", m->ops->name);
+  ppu_mirroring_set (m->mirroring);
+  cpu_irq_set (CPU_IRQ_MAPPER, false);
+  m->ops->reset (m);
+}
+
+// IRQ Counter
+//
+// For mappers that count PPU A12 edges (scanlines). The scheduler keeps
+// one event for the mapper: after any clock or register write it asks
+// how many clocks remain before the IRQ, -1 for none, and schedules the
+// timestamp of that edge.
+
+bool
+mapper_has_counter (const mapper_t *m)
+{
+  return m->ops->clock != NULL;
+}
+
+void
+mapper_clock (mapper_t *m, int clocks)
+{
+  if (m->ops->clock != NULL && clocks > 0)
+    m->ops->clock (m, clocks);
+}
+
+int
+mapper_irq_clocks (mapper_t *m)
+{
+  return m->ops->irq_clocks != NULL ? m->ops->irq_clocks (m) : -1;
+}
@@ -1,9 +1,20 @@
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__) && !defined(PPU_NO_SIMD)
+#define PPU_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSSE3__) && !defined(PPU_NO_SIMD)
+#define PPU_SIMD_SSSE3
+#include <tmmintrin.h>
+#endif
+
 #define MASK_BYTE 0xFF
 #define MASK_WORD 0xFFFF
 #define MASK_PPU_ADDR 0x3FFF
@@ -23,23 +34,70 @@
 #define SCANLINE_VISIBLE 240
 #define SCANLINE_VBLANK_START 241
 #define SCANLINE_FRAME_END 261
+#define CYCLE_VERT_COPY 280
 #define CYCLES_PER_SCANLINE 341
 #define CYCLES_PER_FRAME (SCANLINE_FRAME_END * CYCLES_PER_SCANLINE)
 
-#define VRAM_SIZE 0xFFFF
-#define OAM_SIZE 0xFF
+#define CIRAM_SIZE 0x0800
+#define NMTBL_SIZE 0x0400
+#define OAM_SIZE 0x100
 #define PALETTE_SIZE 32
 #define PRIMARY_BUFFER_SIZE 64
 #define SECONDARY_BUFFER_SIZE 8
 
-static struct
+#define FRAME_WIDTH 256
+#define FRAME_HEIGHT SCANLINE_VISIBLE
+#define TILE_SIZE 8
+#define TILES_PER_LINE (FRAME_WIDTH / TILE_SIZE + 1)
+
+#define MASK_PALETTE_ADDR 0x1F
+#define MASK_PALETTE_MIRROR 0x0F
+#define MASK_FINE_X 0x07
+#define NMTBL_BASE 0x2000
+#define NMTBL_ATTR_OFFSET 0x03C0
+#define PALETTE_BASE 0x3F00
+#define PATTERN_HI_OFFSET 8
+#define PATTERN_TABLE_HI 0x1000
+
+#define PPU_MIRROR_HORIZONTAL 0
+#define PPU_MIRROR_VERTICAL 1
+#define PPU_MIRROR_SINGLE_A 2
+#define PPU_MIRROR_SINGLE_B 3
+#define PPU_MIRROR_FOUR_SCREEN 4
+
+#define CHR_SIZE 0x2000
+#define CHR_TILES (CHR_SIZE / 16)
+#define CHR_WINDOW_SIZE 0x0400
+#define CHR_WINDOWS (CHR_SIZE / CHR_WINDOW_SIZE)
+#define CHR_TILES_PER_WINDOW (CHR_WINDOW_SIZE / 16)
+#define MASK_TILE_ROW 0x07
+
+#define SPRITE_PALETTE_BASE 0x10
+#define OAM_SPRITE_SIZE 4
+
+#define PPU_COLORS 64
+#define PPU_EMPHASIS_MODES 8
+#define MASK_COLOR 0x3F
+#define MASK_GRAYSCALE 0x30
+
+#define PPU_FORMAT_RGBA8888 0
+#define PPU_FORMAT_BGRA8888 1
+#define PPU_FORMAT_RGB565 2
+#define PPU_FORMATS 3
+
+#define PPU_CACHE_LINE 64
+
+#define LANES_01 0x0101010101010101ULL
+#define LANES_04 0x0404040404040404ULL
+
+typedef struct
 {
   uint8_t vblank : 1;
   uint8_t sprite_zero : 1;
   uint8_t sprite_ovf : 1;
-} STATUS;
+} ppu_status_t;
 
-static struct
+typedef struct
 {
   uint8_t nmi_enbl : 1;
   uint8_t master_slave : 1;
@@ -48,9 +106,9 @@ static struct
   uint8_t sprite_pattern_addr : 1;
   uint8_t increment_mode : 1;
   uint8_t nametbl_addr : 2;
-} CTRL;
+} ppu_ctrl_t;
 
-static struct
+typedef struct
 {
   uint8_t emph_blue : 1;
   uint8_t emph_green : 1;
@@ -60,13 +118,14 @@ static struct
   uint8_t sprite_lcol : 1;
   uint8_t bg_lcol : 1;
   uint8_t grayscale : 1;
-} MASK;
+} ppu_mask_t;
 
-static struct
+typedef struct
 {
   uint8_t oam_addr;
   uint8_t scroll_x;
   uint8_t scroll_y;
+  uint16_t origin_y; // Plane y of line 0, see ppu_bg_world_y
   uint8_t data_buffer;
   uint16_t addr;
   uint8_t fine_x;
@@ -77,36 +136,384 @@ static struct
   uint16_t curr_cycle;
   size_t frame_count;
   bool even_frame;
-} PPU;
+  uint16_t render_x;
+  uint8_t sprite_count;
+} ppu_regs_t;
 
-static struct
+typedef struct
 {
   bool rendering_enbl;
   bool vblank_started;
   bool vblank_supprsd;
-} PCONFIG;
+  bool sprite_zero_line;
+  // The four logical nametables, in CIRAM or the four-screen RAM
+  uint8_t *nmtbl[4];
+} ppu_config_t;
+
+// The memory on the PPU's side of the console: the cartridge's 8 KiB of
+// CHR RAM, when it has no CHR ROM, the 2 KiB of CIRAM holding the two
+// physical nametables, the 2 KiB a four-screen cartridge adds for the
+// other two, object memory and palette RAM.
 
-static struct
+typedef struct
 {
-  uint8_t vram[VRAM_SIZE];
+  uint8_t chr_ram[CHR_SIZE] __attribute__ ((aligned (PPU_CACHE_LINE)));
+  uint8_t ciram[CIRAM_SIZE];
+  uint8_t four_screen[CIRAM_SIZE];
   uint8_t oam[OAM_SIZE];
   uint8_t palette[PALETTE_SIZE];
-} PMEMORY;
+} ppu_memory_t;
 
-static struct
+#define PMEMORY_PAGES ((sizeof (ppu_memory_t) + 0xFF) >> 8)
+#define PMEMORY_DIRTY_WORDS ((PMEMORY_PAGES + 63) / 64)
+
+typedef struct
 {
   uint8_t x, y;
   uint8_t tile_idx;
   uint8_t attrs;
-} PRIMARY_BUFFER[PRIMARY_BUFFER_SIZE];
+} ppu_sprite_t;
 
-static struct
+typedef struct
 {
   uint8_t x, y;
   uint8_t tile_idx;
   uint8_t attrs;
-  uint8_t patt_lo, patt_hi;
-} SECONDARY_BUFFER[SECONDARY_BUFFER_SIZE];
+  uint8_t pixels[TILE_SIZE];
+} ppu_sprite_slot_t;
+
+// The sprites of the current line, composited ahead of the background:
+// the palette address of the winning sprite pixel (0 if none), whether
+// it sits behind the background, and whether sprite 0 is opaque there.
+// Padded so a sprite at X 255 can still be written 8 pixels at a time.
+
+typedef struct
+{
+  uint8_t pixels[FRAME_WIDTH + TILE_SIZE];
+  uint8_t behind[FRAME_WIDTH + TILE_SIZE];
+  uint8_t zero[FRAME_WIDTH + TILE_SIZE];
+} ppu_sprite_line_t;
+
+// Eight pixels of a pattern plane, one per byte lane, leftmost pixel in
+// the lowest-addressed byte. A tile row is `lo | hi << 1'. Built by the
+// preprocessor so every context shares it without initialization.
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define TRD_LANE(x) (8 * (7 - (x)))
+#else
+#define TRD_LANE(x) (8 * (x))
+#endif
+#define TRD_BIT(b, x) ((uint64_t)(((b) >> (7 - (x))) & 1) << TRD_LANE (x))
+#define TRD_1(b)                                                              \
+  (TRD_BIT (b, 0) | TRD_BIT (b, 1) | TRD_BIT (b, 2) | TRD_BIT (b, 3)          \
+   | TRD_BIT (b, 4) | TRD_BIT (b, 5) | TRD_BIT (b, 6) | TRD_BIT (b, 7))
+#define TRD_4(b) TRD_1 (b), TRD_1 (b + 1), TRD_1 (b + 2), TRD_1 (b + 3)
+#define TRD_16(b) TRD_4 (b), TRD_4 (b + 4), TRD_4 (b + 8), TRD_4 (b + 12)
+#define TRD_64(b) TRD_16 (b), TRD_16 (b + 16), TRD_16 (b + 32), TRD_16 (b + 48)
+
+static const uint64_t TILE_ROW_DECODE[UINT8_MAX + 1] = {
+  TRD_64 (0), TRD_64 (64), TRD_64 (128), TRD_64 (192),
+};
+
+// Pattern tiles decoded to one byte (0-3) per pixel, kept by where the
+// tile lives rather than by where it is mapped: CHR RAM's tiles in the
+// context, CHR ROM's in a store as large as the ROM (see ppu_chr_rom).
+// Each 1 KiB window of the pattern space points into the store of the
+// bank it shows, so a bank switch only moves pointers, and a ROM tile is
+// decoded once however often its bank comes and goes. Only a write to a
+// RAM tile drops it. Bytes from neither, such as a ROM the PPU was not
+// told about, are decoded on every use.
+
+typedef uint8_t ppu_chr_tile_t[TILE_SIZE][TILE_SIZE];
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t invalidations;
+} ppu_chr_cache_stats_t;
+
+typedef struct
+{
+  // Per window: its bytes, and the decoded tiles and valid flags of its
+  // bank, NULL if uncached. Only windows on CHR RAM can be written.
+  uint8_t *window_bytes[CHR_WINDOWS];
+  ppu_chr_tile_t *window_tiles[CHR_WINDOWS];
+  bool *window_valid[CHR_WINDOWS];
+  bool window_ram[CHR_WINDOWS];
+  // The cartridge's CHR ROM and its decoded tiles, owned by the context
+  const uint8_t *rom;
+  size_t rom_size;
+  ppu_chr_tile_t *rom_tiles;
+  bool *rom_valid;
+  ppu_chr_tile_t scratch;
+  ppu_chr_cache_stats_t stats;
+  // The decoded tiles of CHR RAM, in the context's cold part
+  struct ppu_chr_ram *ram;
+} ppu_chr_cache_t;
+
+typedef struct ppu_chr_ram
+{
+  ppu_chr_tile_t tiles[CHR_TILES];
+  bool valid[CHR_TILES];
+} ppu_chr_ram_t;
+
+// The host's colours, for each output format and emphasis mode (the
+// PPUMASK bits 5-7, red in bit 0): every colour index as the bytes of
+// its pixel in memory order, and the same bytes split into one plane
+// per byte for the SIMD conversion. Read-only once built, and shared by
+// every context that uses it.
+
+typedef struct ppu_palette
+{
+  uint8_t pixels[PPU_FORMATS][PPU_EMPHASIS_MODES][PPU_COLORS][4];
+  uint8_t planes[PPU_FORMATS][PPU_EMPHASIS_MODES][4][PPU_COLORS];
+} ppu_palette_t;
+
+// Render Thread State
+//
+// In pipelined mode the emulating thread keeps only what the CPU can
+// observe (VBL, sprite 0 hit, sprite overflow, memory) and logs every
+// input that changes the picture, stamped with the dot it happened on.
+// A render thread replays each frame's log against its own copy of the
+// PPU, the shadow, while the next frame is emulated.
+
+#define PPU_LOG_REG_WRITE 0
+#define PPU_LOG_REG_READ 1
+#define PPU_LOG_MIRRORING 2
+#define PPU_LOG_CHR_MAP 3
+#define PPU_LOG_RENDER_SKIP 4
+
+#define PPU_LOG_INITIAL_SIZE 4096
+
+typedef struct
+{
+  uint32_t dot; // scanline * CYCLES_PER_SCANLINE + cycle
+  uint8_t kind;
+  uint8_t value;
+  uint16_t reg;
+  int window;
+  int bank;
+  uint8_t *bytes;
+} ppu_log_entry_t;
+
+typedef struct
+{
+  ppu_log_entry_t *entries;
+  size_t count;
+  size_t capacity;
+} ppu_log_t;
+
+typedef struct ppu_pipeline
+{
+  struct ppu_context *shadow;
+  ppu_log_t log[2];
+  int filling;   // Log the emulating thread appends to
+  int replaying; // Log the render thread replays
+  bool busy;     // The render thread has a frame to replay
+  bool resync;   // Copy the shadow over again at the end of the frame
+  bool quit;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} ppu_pipeline_t;
+
+// PPU Context
+//
+// One machine's PPU, selected per thread like the CPU's context (see
+// cpu_context_select in CPU.c), through the same kind of accessor.
+//
+// What every dot reads comes first: the registers, the nametable and
+// CHR pointers and the flags that pick the path through a line, then
+// the memory and the tables a drawn line goes through. The host's
+// colours are only a pointer to tables shared between contexts (see
+// ppu_palette_new).
+//
+// The decoded CHR RAM tiles and the frame are each the size of the rest
+// several times over, and a line touches only a sliver of them, so they
+// live in a cold part placed apart from the context.
+
+typedef struct ppu_cold
+{
+  ppu_chr_ram_t chr_ram;
+  // One colour index (0-63) per pixel, and per line the emphasis mode
+  // it was drawn with. Pixels of the current line hold palette RAM
+  // addresses (0-31, zero the backdrop) until they are flushed.
+  uint8_t frame[FRAME_HEIGHT][FRAME_WIDTH]
+      __attribute__ ((aligned (PPU_CACHE_LINE)));
+  uint8_t emphasis[FRAME_HEIGHT];
+} ppu_cold_t;
+
+typedef struct ppu_context
+{
+  ppu_status_t status;
+  ppu_ctrl_t ctrl;
+  ppu_mask_t mask;
+  ppu_regs_t ppu;
+  ppu_config_t pconfig;
+  // Non-NULL in pipelined mode
+  ppu_pipeline_t *pipeline;
+  // Set by the host, not part of the machine's state
+  const ppu_palette_t *palette;
+  bool render_skip;
+  // 256-byte pages of `pmemory' written since the last snapshot
+  uint64_t dirty[PMEMORY_DIRTY_WORDS];
+  ppu_sprite_t primary_buffer[PRIMARY_BUFFER_SIZE];
+  ppu_sprite_slot_t secondary_buffer[SECONDARY_BUFFER_SIZE];
+  ppu_memory_t pmemory;
+  ppu_sprite_line_t sprite_line;
+  ppu_chr_cache_t chr_cache;
+  ppu_cold_t *cold;
+} ppu_context_t;
+
+static ppu_cold_t PPU_DEFAULT_COLD;
+static ppu_context_t PPU_DEFAULT_CONTEXT
+    = { .chr_cache = { .ram = &PPU_DEFAULT_COLD.chr_ram },
+        .cold = &PPU_DEFAULT_COLD };
+static _Thread_local ppu_context_t *PPU_CONTEXT = &PPU_DEFAULT_CONTEXT;
+
+static inline ppu_context_t *
+ppu_context_get (void)
+{
+  return PPU_CONTEXT;
+}
+
+#define STATUS (ppu_context_get ()->status)
+#define CTRL (ppu_context_get ()->ctrl)
+#define MASK (ppu_context_get ()->mask)
+#define PPU (ppu_context_get ()->ppu)
+#define PCONFIG (ppu_context_get ()->pconfig)
+#define PMEMORY (ppu_context_get ()->pmemory)
+#define PRIMARY_BUFFER (ppu_context_get ()->primary_buffer)
+#define SECONDARY_BUFFER (ppu_context_get ()->secondary_buffer)
+#define SPRITE_LINE (ppu_context_get ()->sprite_line)
+#define FRAME (ppu_context_get ()->cold->frame)
+#define EMPHASIS (ppu_context_get ()->cold->emphasis)
+#define PPALETTE (ppu_context_get ()->palette)
+#define CHR_CACHE (ppu_context_get ()->chr_cache)
+#define PDIRTY (ppu_context_get ()->dirty)
+#define PPIPELINE (ppu_context_get ()->pipeline)
+#define RENDER_SKIP (ppu_context_get ()->render_skip)
+
+// Placement in the host's own memory, as for the CPU's context (see
+// cpu_context_place): PPU_CACHE_LINE-aligned, ppu_context_size bytes,
+// and ppu_context_cold_size bytes for the cold part. Releasing a
+// context stops its render thread and frees the decoded tiles of its
+// CHR ROM.
+
+size_t
+ppu_context_size (void)
+{
+  return sizeof (ppu_context_t);
+}
+
+size_t
+ppu_context_cold_size (void)
+{
+  return sizeof (ppu_cold_t);
+}
+
+ppu_context_t *
+ppu_context_place (void *mem, void *cold)
+{
+  ppu_context_t *ctx = memset (mem, 0, sizeof (ppu_context_t));
+
+  ctx->cold = memset (cold, 0, sizeof (ppu_cold_t));
+  ctx->chr_cache.ram = &ctx->cold->chr_ram;
+  return ctx;
+}
+
+static void ppu_pipeline_end (ppu_pipeline_t *pipeline);
+static bool ppu_chr_rom_store (ppu_chr_cache_t *cache, const uint8_t *chr,
+                               size_t size);
+
+void
+ppu_context_release (ppu_context_t *ctx)
+{
+  if (ctx->pipeline != NULL)
+    ppu_pipeline_end (ctx->pipeline);
+  ctx->pipeline = NULL;
+  ppu_chr_rom_store (&ctx->chr_cache, NULL, 0);
+  if (PPU_CONTEXT == ctx)
+    PPU_CONTEXT = &PPU_DEFAULT_CONTEXT;
+}
+
+ppu_context_t *
+ppu_context_new (void)
+{
+  uint8_t *mem = aligned_alloc (PPU_CACHE_LINE, sizeof (ppu_context_t)
+                                                    + sizeof (ppu_cold_t));
+
+  return mem != NULL ? ppu_context_place (mem, mem + sizeof (ppu_context_t))
+                     : NULL;
+}
+
+void
+ppu_context_free (ppu_context_t *ctx)
+{
+  ppu_context_release (ctx);
+  free (ctx);
+}
+
+void
+ppu_context_select (ppu_context_t *ctx)
+{
+  PPU_CONTEXT = ctx;
+}
+
+ppu_context_t *
+ppu_context_current (void)
+{
+  return PPU_CONTEXT;
+}
+
+// Render Log
+//
+// Appends an input to the frame's log in pipelined mode; otherwise, and
+// on the render thread, whose shadow has no pipeline, does nothing. An
+// input that cannot be logged leaves the shadow behind, so it is copied
+// over again at the end of the frame.
+
+static inline uint32_t
+ppu_dot (void)
+{
+  return PPU.curr_scanline * CYCLES_PER_SCANLINE + PPU.curr_cycle;
+}
+
+static void
+ppu_log (uint8_t kind, uint16_t reg, uint8_t value, int window, int bank,
+         uint8_t *bytes)
+{
+  ppu_pipeline_t *pipeline = PPIPELINE;
+
+  if (pipeline == NULL)
+    return;
+
+  ppu_log_t *log = &pipeline->log[pipeline->filling];
+  if (log->count == log->capacity)
+    {
+      size_t grown = 2 * log->capacity;
+      ppu_log_entry_t *entries
+          = realloc (log->entries, grown * sizeof (*entries));
+      if (entries == NULL)
+        {
+          pipeline->resync = true;
+          return;
+        }
+      log->entries = entries;
+      log->capacity = grown;
+    }
+
+  log->entries[log->count++] = (ppu_log_entry_t){
+    .dot = ppu_dot (),
+    .kind = kind,
+    .value = value,
+    .reg = reg,
+    .window = window,
+    .bank = bank,
+    .bytes = bytes,
+  };
+}
 
 // Nametable Functions
 
@@ -116,21 +523,1575 @@ ppu_nmtbl_get_idx (uint16_t addr)
   return (addr & MASK_NMTBL_BASE) >> 10;
 }
 
-staitc inline uint16_t
+static inline uint8_t *
 ppu_nmtbl_get_mirror (uint16_t addr)
 {
-  uint16_t base = addr & MASK_NMTBL_BASE;
-  uint8_t nt_idx = base >> 10;
+  return &PCONFIG.nmtbl[ppu_nmtbl_get_idx (addr)][addr & MASK_NMTBL_MIRROR];
+}
+
+// The console has two physical nametables; the cartridge decides which
+// of them each of the four logical ones shows, or, on a four-screen
+// board, gives the last two RAM of their own. `mode' is one of the
+// PPU_MIRROR_* layouts: the mapper sets the one from the cartridge
+// header on reset, and mappers that switch mirroring call this from
+// their register writes. An unknown mode is taken as horizontal.
+
+void
+ppu_mirroring_set (int mode)
+{
+  static const uint8_t LAYOUT[PPU_MIRROR_FOUR_SCREEN + 1][4] = {
+    [PPU_MIRROR_HORIZONTAL] = { 0, 0, 1, 1 },
+    [PPU_MIRROR_VERTICAL] = { 0, 1, 0, 1 },
+    [PPU_MIRROR_SINGLE_A] = { 0, 0, 0, 0 },
+    [PPU_MIRROR_SINGLE_B] = { 1, 1, 1, 1 },
+    [PPU_MIRROR_FOUR_SCREEN] = { 0, 1, 2, 3 },
+  };
+
+  if (mode < 0 || mode > PPU_MIRROR_FOUR_SCREEN)
+    mode = PPU_MIRROR_HORIZONTAL;
 
-  switch (nt_idx)
+  ppu_log (PPU_LOG_MIRRORING, 0, mode, 0, 0, NULL);
+  for (int i = 0; i < 4; i++)
     {
-    case 1:
-      return (base & MASK_NMTBL_MIRROR) | 0x2000;
-    case 2:
-      return (base & MASK_NMTBL_MIRROR) | 0x2800;
-    case 3:
-      return (base & MASK_NMTBL_MIRROR) | 0x2800;
-    default:
-      return addr;
+      int table = LAYOUT[mode][i];
+
+      PCONFIG.nmtbl[i] = table < 2 ? &PMEMORY.ciram[table * NMTBL_SIZE]
+                                   : &PMEMORY.four_screen[(table - 2)
+                                                          * NMTBL_SIZE];
+    }
+}
+
+// PPU Memory Operations
+
+static inline void
+ppu_mem_mark (const uint8_t *byte)
+{
+  size_t page = (size_t)(byte - (const uint8_t *)&PMEMORY) >> 8;
+
+  PDIRTY[page >> 6] |= 1ULL << (page & 63);
+}
+
+// Hands over the pages of PMEMORY written since the last call, as a
+// bitmap of its 256-byte pages, and starts a new set. A NULL `dirty'
+// just clears the set.
+
+void
+ppu_mem_dirty_take (uint64_t dirty[PMEMORY_DIRTY_WORDS])
+{
+  if (dirty != NULL)
+    memcpy (dirty, PDIRTY, sizeof (PDIRTY));
+  memset (PDIRTY, 0, sizeof (PDIRTY));
+}
+
+static inline uint8_t
+ppu_palette_idx (uint16_t addr)
+{
+  uint8_t idx = addr & MASK_PALETTE_ADDR;
+
+  // $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C
+  if (idx >= 0x10 && (idx & 0x03) == 0)
+    idx &= MASK_PALETTE_MIRROR;
+  return idx;
+}
+
+// Pattern memory is reached through the CHR windows, which the mapper
+// points at cartridge CHR ROM or at the PPU's own 8 KiB of CHR RAM.
+
+static inline uint8_t *
+ppu_chr_byte (uint16_t addr)
+{
+  return &CHR_CACHE.window_bytes[addr / CHR_WINDOW_SIZE]
+                                [addr & (CHR_WINDOW_SIZE - 1)];
+}
+
+static uint8_t
+ppu_mem_read (uint16_t addr)
+{
+  addr &= MASK_PPU_ADDR;
+
+  if (addr < NMTBL_BASE)
+    return *ppu_chr_byte (addr);
+  else if (addr < PALETTE_BASE)
+    return *ppu_nmtbl_get_mirror (addr);
+  else
+    return PMEMORY.palette[ppu_palette_idx (addr)];
+}
+
+static void ppu_chr_invalidate (uint16_t addr);
+
+static void
+ppu_mem_write (uint16_t addr, uint8_t value)
+{
+  addr &= MASK_PPU_ADDR;
+
+  if (addr < NMTBL_BASE)
+    {
+      if (!CHR_CACHE.window_ram[addr / CHR_WINDOW_SIZE])
+        return;
+      *ppu_chr_byte (addr) = value;
+      ppu_mem_mark (ppu_chr_byte (addr));
+      ppu_chr_invalidate (addr);
+    }
+  else if (addr < PALETTE_BASE)
+    {
+      uint8_t *byte = ppu_nmtbl_get_mirror (addr);
+      *byte = value;
+      ppu_mem_mark (byte);
+    }
+  else
+    {
+      uint8_t idx = ppu_palette_idx (addr);
+      PMEMORY.palette[idx] = value;
+      ppu_mem_mark (&PMEMORY.palette[idx]);
+    }
+}
+
+// CHR Tile Cache
+
+static void
+ppu_chr_decode (uint16_t tile, ppu_chr_tile_t out)
+{
+  uint16_t addr = tile << 4;
+
+  for (int row = 0; row < TILE_SIZE; row++)
+    {
+      uint64_t pixels = TILE_ROW_DECODE[*ppu_chr_byte (addr + row)]
+                        | TILE_ROW_DECODE[*ppu_chr_byte (
+                              addr + row + PATTERN_HI_OFFSET)]
+                              << 1;
+      memcpy (out[row], &pixels, TILE_SIZE);
+    }
+}
+
+// Returns the 8 decoded pixels of the pattern row at `addr' (tile << 4
+// | row, plus the $1000 table bit).
+
+static inline const uint8_t *
+ppu_chr_row (uint16_t addr)
+{
+  uint16_t tile = (addr & (CHR_SIZE - 1)) >> 4;
+  int window = tile / CHR_TILES_PER_WINDOW;
+  bool *valid = CHR_CACHE.window_valid[window];
+  ppu_chr_tile_t *tiles = CHR_CACHE.window_tiles[window];
+  int idx = tile % CHR_TILES_PER_WINDOW;
+
+  if (valid == NULL)
+    {
+      CHR_CACHE.stats.misses++;
+      ppu_chr_decode (tile, CHR_CACHE.scratch);
+      return CHR_CACHE.scratch[addr & MASK_TILE_ROW];
+    }
+
+  if (valid[idx])
+    CHR_CACHE.stats.hits++;
+  else
+    {
+      CHR_CACHE.stats.misses++;
+      ppu_chr_decode (tile, tiles[idx]);
+      valid[idx] = true;
+    }
+  return tiles[idx][addr & MASK_TILE_ROW];
+}
+
+// Drops the decoded RAM tile under `addr', if its window is on CHR RAM.
+
+static void
+ppu_chr_invalidate (uint16_t addr)
+{
+  int window = (addr & (CHR_SIZE - 1)) / CHR_WINDOW_SIZE;
+  size_t tile;
+
+  if (!CHR_CACHE.window_ram[window])
+    return;
+
+  tile = (CHR_CACHE.window_bytes[window] - PMEMORY.chr_ram
+          + (addr & (CHR_WINDOW_SIZE - 1)))
+         >> 4;
+  if (CHR_CACHE.ram->valid[tile])
+    {
+      CHR_CACHE.ram->valid[tile] = false;
+      CHR_CACHE.stats.invalidations++;
+    }
+}
+
+// Points window `window' of `cache' at `bytes' and at the decoded tiles
+// of the bank they hold. Takes the cache and its CHR RAM explicitly, so
+// that the pipeline can set up a shadow's windows from the emulating
+// thread.
+
+static void
+ppu_chr_window_set (ppu_chr_cache_t *cache, uint8_t *chr_ram, int window,
+                    uint8_t *bytes)
+{
+  size_t tile;
+
+  cache->window_bytes[window] = bytes;
+  cache->window_ram[window] = bytes >= chr_ram && bytes < chr_ram + CHR_SIZE;
+  cache->window_tiles[window] = NULL;
+  cache->window_valid[window] = NULL;
+
+  if (cache->window_ram[window])
+    {
+      tile = (bytes - chr_ram) >> 4;
+      cache->window_tiles[window] = &cache->ram->tiles[tile];
+      cache->window_valid[window] = &cache->ram->valid[tile];
+    }
+  else if (cache->rom_tiles != NULL && bytes >= cache->rom
+           && bytes + CHR_WINDOW_SIZE <= cache->rom + cache->rom_size
+           && (bytes - cache->rom) % 16 == 0)
+    {
+      tile = (bytes - cache->rom) >> 4;
+      cache->window_tiles[window] = &cache->rom_tiles[tile];
+      cache->window_valid[window] = &cache->rom_valid[tile];
+    }
+}
+
+// Replaces the ROM store of `cache' with an empty one for `chr', or with
+// none if `chr' is NULL. Returns false if there is no memory for it.
+
+static bool
+ppu_chr_rom_store (ppu_chr_cache_t *cache, const uint8_t *chr, size_t size)
+{
+  free (cache->rom_tiles);
+  free (cache->rom_valid);
+  cache->rom = NULL;
+  cache->rom_size = 0;
+  cache->rom_tiles = NULL;
+  cache->rom_valid = NULL;
+
+  if (chr == NULL || size < CHR_WINDOW_SIZE)
+    return true;
+
+  cache->rom_tiles = malloc (size / 16 * sizeof (ppu_chr_tile_t));
+  cache->rom_valid = calloc (size / 16, sizeof (bool));
+  if (cache->rom_tiles == NULL || cache->rom_valid == NULL)
+    {
+      ppu_chr_rom_store (cache, NULL, 0);
+      return false;
+    }
+  cache->rom = chr;
+  cache->rom_size = size;
+  return true;
+}
+
+// Points 1 KiB window `window' ($0000, $0400, ... $1C00) at `bytes'.
+// NULL selects the PPU's own CHR RAM, bank `bank' of its eight; a
+// cartridge has either CHR ROM or CHR RAM, and only the latter can be
+// written through PPUDATA. Larger banks are several windows.
+
+void
+ppu_chr_map (int window, uint8_t *bytes, int bank)
+{
+  ppu_log (PPU_LOG_CHR_MAP, 0, 0, window, bank, bytes);
+  if (bytes == NULL)
+    {
+      bank %= CHR_WINDOWS;
+      bytes = &PMEMORY.chr_ram[bank * CHR_WINDOW_SIZE];
+    }
+  ppu_chr_window_set (&CHR_CACHE, PMEMORY.chr_ram, window, bytes);
+}
+
+// Tells the PPU the cartridge's CHR ROM, which must outlive it, so that
+// each of its tiles is decoded at most once; NULL for boards with CHR
+// RAM. Call after ppu_init, which forgets it, and before mapping its
+// banks. Returns false if there is no memory for the decoded tiles, in
+// which case they are decoded on every use.
+
+bool
+ppu_chr_rom (const uint8_t *chr, size_t size)
+{
+  bool stored = ppu_chr_rom_store (&CHR_CACHE, chr, size);
+
+  for (int window = 0; window < CHR_WINDOWS; window++)
+    ppu_chr_window_set (&CHR_CACHE, PMEMORY.chr_ram, window,
+                        CHR_CACHE.window_bytes[window]);
+  if (PPIPELINE != NULL)
+    PPIPELINE->resync = true;
+  return stored;
+}
+
+ppu_chr_cache_stats_t
+ppu_chr_cache_stats (void)
+{
+  return CHR_CACHE.stats;
+}
+
+static void
+ppu_chr_cache_reset (void)
+{
+  ppu_chr_ram_t *ram = CHR_CACHE.ram;
+
+  ppu_chr_rom_store (&CHR_CACHE, NULL, 0);
+  memset (&CHR_CACHE, 0, sizeof (CHR_CACHE));
+  memset (ram->valid, 0, sizeof (ram->valid));
+  CHR_CACHE.ram = ram;
+  for (int window = 0; window < CHR_WINDOWS; window++)
+    ppu_chr_window_set (&CHR_CACHE, PMEMORY.chr_ram, window,
+                        &PMEMORY.chr_ram[window * CHR_WINDOW_SIZE]);
+}
+
+// Background Fetch
+//
+// The screen is a window into a 512x480 plane of four nametables. `wx'
+// and `wy' are coordinates in that plane, already scrolled.
+//
+// PPUSCROLL, PPUCTRL's nametable bits and PPUADDR all write the chip's
+// temporary address. Horizontal scroll is read from it as written, so a
+// write mid-line moves the rest of that line (the chip would wait for
+// dot 257). Vertical scroll is copied into `origin_y' only where the
+// chip copies it: at the pre-render line with rendering on, and by the
+// second write of PPUADDR, which takes effect from the next line. A
+// PPUSCROLL write mid-frame therefore moves the picture only from the
+// next frame.
+
+static inline uint16_t
+ppu_bg_world_x (uint16_t x)
+{
+  return (x + PPU.scroll_x + ((CTRL.nametbl_addr & 1) << 8)) & 0x1FF;
+}
+
+static inline uint16_t
+ppu_bg_world_y (uint16_t y)
+{
+  return (PPU.origin_y + y) % (FRAME_HEIGHT * 2);
+}
+
+// The plane y that the temporary address points at
+static inline uint16_t
+ppu_bg_scroll_y (void)
+{
+  return PPU.scroll_y + (CTRL.nametbl_addr >> 1) * FRAME_HEIGHT;
+}
+
+static inline const uint8_t *
+ppu_bg_fetch (uint16_t wx, uint16_t wy, uint8_t *palette)
+{
+  uint8_t nt_y = wy >= FRAME_HEIGHT;
+  uint8_t row = wy - nt_y * FRAME_HEIGHT;
+  uint8_t tile_x = (wx & MASK_BYTE) >> 3;
+  uint8_t tile_y = row >> 3;
+  const uint8_t *nt = PCONFIG.nmtbl[(wx >> 8) | nt_y << 1];
+
+  uint8_t tile_idx = nt[tile_y << 5 | tile_x];
+  uint8_t attr = nt[NMTBL_ATTR_OFFSET | (tile_y >> 2) << 3 | tile_x >> 2];
+  uint16_t patt = (CTRL.bg_pattern_addr ? PATTERN_TABLE_HI : 0)
+                  | tile_idx << 4 | (row & MASK_FINE_X);
+
+  *palette = (attr >> ((tile_y & 0x02) << 1 | (tile_x & 0x02))) & 0x03;
+  return ppu_chr_row (patt);
+}
+
+// Background Rendering -- Per Dot
+//
+// The reference path: every pixel fetches its own tile, attribute and
+// pattern row. Used for the part of a line around a mid-line register
+// write, where the registers differ from pixel to pixel.
+
+static inline bool
+ppu_bg_visible (uint16_t x)
+{
+  return MASK.bg_enbl && (x >= TILE_SIZE || MASK.bg_lcol);
+}
+
+static void
+ppu_render_dots (uint16_t from, uint16_t to)
+{
+  uint16_t y = PPU.curr_scanline;
+  uint16_t wy = ppu_bg_world_y (y);
+  uint8_t palette;
+
+  for (uint16_t x = from; x < to; x++)
+    {
+      if (!ppu_bg_visible (x))
+        {
+          FRAME[y][x] = 0;
+          continue;
+        }
+
+      uint16_t wx = ppu_bg_world_x (x);
+      const uint8_t *row = ppu_bg_fetch (wx, wy, &palette);
+      uint8_t pixel = row[wx & MASK_FINE_X];
+      FRAME[y][x] = pixel ? (palette << 2 | pixel) : 0;
+    }
+}
+
+// Background Rendering -- Per Scanline
+//
+// When no register changed during the line, each of the 33 tiles it
+// touches is fetched once and its decoded row turned into 8 palette
+// addresses with a few 64-bit operations. The row is
+// built in a staging buffer aligned to the tile grid and the fine X
+// scroll is applied by the final copy.
+
+static inline uint64_t
+ppu_tile_row (const uint8_t *row, uint8_t palette)
+{
+  uint64_t pixels;
+  memcpy (&pixels, row, TILE_SIZE);
+  uint64_t opaque = ((pixels | pixels >> 1) & LANES_01) * MASK_BYTE;
+
+  return pixels | (palette * LANES_04 & opaque);
+}
+
+static void
+ppu_render_scanline (void)
+{
+  uint16_t y = PPU.curr_scanline;
+  uint8_t line[TILES_PER_LINE * TILE_SIZE];
+  uint8_t palette;
+
+  if (!MASK.bg_enbl)
+    {
+      memset (FRAME[y], 0, FRAME_WIDTH);
+      return;
+    }
+
+  uint16_t wx = ppu_bg_world_x (0);
+  uint16_t wy = ppu_bg_world_y (y);
+  uint8_t fine_x = wx & MASK_FINE_X;
+
+  wx &= ~MASK_FINE_X;
+  for (int tile = 0; tile < TILES_PER_LINE; tile++)
+    {
+      const uint8_t *pixels = ppu_bg_fetch (wx, wy, &palette);
+      uint64_t row = ppu_tile_row (pixels, palette);
+      memcpy (&line[tile * TILE_SIZE], &row, TILE_SIZE);
+      wx = (wx + TILE_SIZE) & 0x1FF;
+    }
+
+  memcpy (FRAME[y], &line[fine_x], FRAME_WIDTH);
+  if (!MASK.bg_lcol)
+    memset (FRAME[y], 0, TILE_SIZE);
+}
+
+// Sprite Pattern Fetch
+//
+// The decoded row of sprite `tile_idx' at `row' (0-7, or 0-15 for 8x16
+// sprites), already flipped as its attributes ask.
+
+#define SPRITE_ATTR_FLIP_V 0x80
+#define SPRITE_ATTR_FLIP_H 0x40
+#define SPRITE_ATTR_BEHIND 0x20
+
+static void
+ppu_sprite_row (uint8_t tile_idx, uint8_t attrs, uint8_t row,
+                uint8_t out[TILE_SIZE])
+{
+  uint8_t height = CTRL.sprite_height ? 2 * TILE_SIZE : TILE_SIZE;
+  uint16_t addr;
+
+  if (attrs & SPRITE_ATTR_FLIP_V)
+    row = height - 1 - row;
+
+  if (CTRL.sprite_height)
+    addr = (tile_idx & 1) * PATTERN_TABLE_HI
+           | ((tile_idx & 0xFE) + (row >= TILE_SIZE)) << 4
+           | (row & MASK_TILE_ROW);
+  else
+    addr = (CTRL.sprite_pattern_addr ? PATTERN_TABLE_HI : 0)
+           | tile_idx << 4 | row;
+
+  const uint8_t *pixels = ppu_chr_row (addr);
+  if (attrs & SPRITE_ATTR_FLIP_H)
+    for (int x = 0; x < TILE_SIZE; x++)
+      out[x] = pixels[TILE_SIZE - 1 - x];
+  else
+    memcpy (out, pixels, TILE_SIZE);
+}
+
+// Sprite Evaluation
+//
+// Finds the first 8 sprites whose Y range covers the current line. The
+// PPU evaluates the line before the one it draws them on, so a sprite's
+// range is Y + 1 to Y + height, and line 0, whose previous line is the
+// pre-render line, has none. The in-range test over all 64 OAM Y bytes
+// yields a 64-bit mask, with SSE2 16 sprites at a time, and the sprites
+// are then taken from the mask in OAM order. Only when 8 were found does
+// the scan go on one sprite at a time, to reproduce the overflow bug:
+// after the eighth sprite the PPU increments the byte index within an
+// entry along with the sprite index, so it compares tile, attribute and
+// X bytes as if they were Y.
+
+static inline bool
+ppu_sprite_in_range (uint8_t y, uint8_t height)
+{
+  uint16_t line = PPU.curr_scanline - 1;
+  return line >= y && line - y < height;
+}
+
+#ifdef PPU_SIMD_SSE2
+static uint64_t
+ppu_sprite_range_mask (uint8_t height)
+{
+  const __m128i low_byte = _mm_set1_epi32 (MASK_BYTE);
+  const __m128i line = _mm_set1_epi8 ((char)(PPU.curr_scanline - 1));
+  const __m128i last_row = _mm_set1_epi8 ((char)(height - 1));
+  uint64_t mask = 0;
+
+  for (int group = 0; group < 4; group++)
+    {
+      const __m128i *oam = (const __m128i *)&PMEMORY.oam[group * 64];
+      __m128i y01 = _mm_packs_epi32 (
+          _mm_and_si128 (_mm_loadu_si128 (oam + 0), low_byte),
+          _mm_and_si128 (_mm_loadu_si128 (oam + 1), low_byte));
+      __m128i y23 = _mm_packs_epi32 (
+          _mm_and_si128 (_mm_loadu_si128 (oam + 2), low_byte),
+          _mm_and_si128 (_mm_loadu_si128 (oam + 3), low_byte));
+      __m128i y = _mm_packus_epi16 (y01, y23);
+
+      // y <= line, and line - y <= height - 1, both unsigned
+      __m128i above = _mm_cmpeq_epi8 (_mm_min_epu8 (y, line), y);
+      __m128i row = _mm_sub_epi8 (line, y);
+      __m128i inside = _mm_cmpeq_epi8 (_mm_min_epu8 (row, last_row), row);
+
+      uint64_t bits = (uint16_t)_mm_movemask_epi8 (_mm_and_si128 (above,
+                                                                  inside));
+      mask |= bits << (group * 16);
     }
+  return mask;
+}
+#else
+static uint64_t
+ppu_sprite_range_mask (uint8_t height)
+{
+  uint64_t mask = 0;
+
+  for (int n = 0; n < PRIMARY_BUFFER_SIZE; n++)
+    if (ppu_sprite_in_range (PMEMORY.oam[n * OAM_SPRITE_SIZE], height))
+      mask |= 1ULL << n;
+  return mask;
+}
+#endif
+
+static void
+ppu_sprite_overflow_scan (int n, uint8_t height)
+{
+  int m = 0;
+
+  for (; n < PRIMARY_BUFFER_SIZE; n++, m = (m + 1) & 3)
+    if (ppu_sprite_in_range (PMEMORY.oam[n * OAM_SPRITE_SIZE + m], height))
+      {
+        STATUS.sprite_ovf = 1;
+        return;
+      }
+}
+
+static void
+ppu_sprite_evaluate (void)
+{
+  uint8_t height = CTRL.sprite_height ? 2 * TILE_SIZE : TILE_SIZE;
+  int count = 0;
+
+  if (PPU.curr_scanline == 0)
+    return;
+
+  uint64_t mask = ppu_sprite_range_mask (height);
+
+  while (mask && count < SECONDARY_BUFFER_SIZE)
+    {
+      int n = __builtin_ctzll (mask);
+      const uint8_t *entry = &PMEMORY.oam[n * OAM_SPRITE_SIZE];
+
+      mask &= mask - 1;
+      SECONDARY_BUFFER[count].y = entry[0];
+      SECONDARY_BUFFER[count].tile_idx = entry[1];
+      SECONDARY_BUFFER[count].attrs = entry[2];
+      SECONDARY_BUFFER[count].x = entry[3];
+      ppu_sprite_row (entry[1], entry[2], PPU.curr_scanline - 1 - entry[0],
+                      SECONDARY_BUFFER[count].pixels);
+      if (n == 0)
+        PCONFIG.sprite_zero_line = true;
+      count++;
+      if (count == SECONDARY_BUFFER_SIZE)
+        ppu_sprite_overflow_scan (n + 1, height);
+    }
+  PPU.sprite_count = count;
+}
+
+// Sprite Line
+//
+// Each found sprite is written into SPRITE_LINE 8 pixels at a time, from
+// the last to the first, so that lower OAM indices end on top where
+// sprites overlap. A transparent sprite pixel leaves what is under it.
+
+static inline uint64_t
+ppu_lanes_nonzero (uint64_t lanes)
+{
+  return ((lanes | lanes >> 1 | lanes >> 2 | lanes >> 3 | lanes >> 4)
+          & LANES_01)
+         * MASK_BYTE;
+}
+
+static inline void
+ppu_lanes_blend (uint8_t *dst, uint64_t src, uint64_t mask)
+{
+  uint64_t lanes;
+
+  memcpy (&lanes, dst, TILE_SIZE);
+  lanes = (lanes & ~mask) | (src & mask);
+  memcpy (dst, &lanes, TILE_SIZE);
+}
+
+static void
+ppu_sprite_line_build (void)
+{
+  memset (&SPRITE_LINE, 0, sizeof (SPRITE_LINE));
+  if (!MASK.sprite_enbl)
+    return;
+
+  for (int i = PPU.sprite_count - 1; i >= 0; i--)
+    {
+      uint8_t attrs = SECONDARY_BUFFER[i].attrs;
+      uint8_t x = SECONDARY_BUFFER[i].x;
+      uint64_t pixels, opaque;
+
+      memcpy (&pixels, SECONDARY_BUFFER[i].pixels, TILE_SIZE);
+      opaque = ppu_lanes_nonzero (pixels);
+      pixels |= (SPRITE_PALETTE_BASE | (attrs & 0x03) << 2) * LANES_01;
+
+      ppu_lanes_blend (&SPRITE_LINE.pixels[x], pixels, opaque);
+      ppu_lanes_blend (&SPRITE_LINE.behind[x],
+                       (attrs & SPRITE_ATTR_BEHIND) ? ~0ULL : 0, opaque);
+      if (i == 0 && PCONFIG.sprite_zero_line)
+        ppu_lanes_blend (&SPRITE_LINE.zero[x], ~0ULL, opaque);
+    }
+
+  if (!MASK.sprite_lcol)
+    memset (SPRITE_LINE.pixels, 0, TILE_SIZE);
+}
+
+// Lays SPRITE_LINE over the background already in FRAME for pixels
+// [from, to), 8 at a time with a pixel-by-pixel tail. Sprite 0 hits
+// where both it and the background are opaque, except at X 255 and in
+// a hidden left column.
+
+static inline bool
+ppu_sprite_zero_hits_at (uint16_t x)
+{
+  return x != FRAME_WIDTH - 1
+         && (x >= TILE_SIZE || (MASK.bg_lcol && MASK.sprite_lcol));
+}
+
+static void
+ppu_sprite_zero_check (uint16_t x, uint64_t hit)
+{
+  uint8_t lanes[TILE_SIZE];
+
+  memcpy (lanes, &hit, TILE_SIZE);
+  for (int i = 0; i < TILE_SIZE; i++)
+    if (lanes[i] && ppu_sprite_zero_hits_at (x + i))
+      {
+        STATUS.sprite_zero = 1;
+        return;
+      }
+}
+
+static void
+ppu_sprite_composite (uint16_t from, uint16_t to)
+{
+  uint8_t *line = FRAME[PPU.curr_scanline];
+  uint16_t x = from;
+
+  if (!MASK.sprite_enbl)
+    return;
+
+  for (; to - x >= TILE_SIZE; x += TILE_SIZE)
+    {
+      uint64_t bg, sprite, behind, zero;
+
+      memcpy (&bg, &line[x], TILE_SIZE);
+      memcpy (&sprite, &SPRITE_LINE.pixels[x], TILE_SIZE);
+      memcpy (&behind, &SPRITE_LINE.behind[x], TILE_SIZE);
+      memcpy (&zero, &SPRITE_LINE.zero[x], TILE_SIZE);
+
+      uint64_t bg_opaque = ppu_lanes_nonzero (bg);
+      uint64_t sprite_opaque = ppu_lanes_nonzero (sprite);
+
+      if ((zero & bg_opaque) && !STATUS.sprite_zero)
+        ppu_sprite_zero_check (x, zero & bg_opaque);
+      ppu_lanes_blend (&line[x], sprite, sprite_opaque & ~(behind & bg_opaque));
+    }
+
+  for (; x < to; x++)
+    {
+      if (!SPRITE_LINE.pixels[x])
+        continue;
+      if (line[x] && SPRITE_LINE.zero[x] && ppu_sprite_zero_hits_at (x))
+        STATUS.sprite_zero = 1;
+      if (!line[x] || !SPRITE_LINE.behind[x])
+        line[x] = SPRITE_LINE.pixels[x];
+    }
+}
+
+// When the line is not drawn here (see ppu_drawing) the CPU can still
+// see sprite 0 hit. Only the background under sprite 0's opaque pixels
+// is fetched, by the same rules as the composite above.
+
+static void
+ppu_sprite_zero_probe (uint16_t from, uint16_t to)
+{
+  uint16_t y = PPU.curr_scanline;
+  uint8_t palette;
+
+  if (!MASK.sprite_enbl || !PCONFIG.sprite_zero_line || STATUS.sprite_zero)
+    return;
+
+  uint16_t wy = ppu_bg_world_y (y);
+  for (uint16_t x = from; x < to; x++)
+    {
+      if (!SPRITE_LINE.zero[x] || !ppu_bg_visible (x)
+          || !ppu_sprite_zero_hits_at (x))
+        continue;
+
+      uint16_t wx = ppu_bg_world_x (x);
+      const uint8_t *row = ppu_bg_fetch (wx, wy, &palette);
+      if (row[wx & MASK_FINE_X])
+        {
+          STATUS.sprite_zero = 1;
+          return;
+        }
+    }
+}
+
+// Palette Lookup
+//
+// A flushed piece of the line goes from palette RAM addresses to colour
+// indices through palette RAM as it is now, so a palette write in the
+// middle of a line (which flushes first) only changes what follows it.
+// With SSSE3 that is a byte shuffle of each half of palette RAM, 16
+// pixels at a time. The line keeps the emphasis bits of its last piece.
+
+#ifdef PPU_SIMD_SSSE3
+static void
+ppu_palette_resolve (uint16_t from, uint16_t to)
+{
+  uint8_t *line = FRAME[PPU.curr_scanline];
+  uint8_t mask = MASK.grayscale ? MASK_GRAYSCALE : MASK_COLOR;
+  const __m128i *palette = (const __m128i *)PMEMORY.palette;
+  const __m128i low = _mm_loadu_si128 (palette);
+  const __m128i high = _mm_loadu_si128 (palette + 1);
+  const __m128i half = _mm_set1_epi8 (MASK_PALETTE_MIRROR);
+  const __m128i color = _mm_set1_epi8 (mask);
+  uint16_t x = from;
+
+  for (; to - x >= 16; x += 16)
+    {
+      __m128i addr = _mm_loadu_si128 ((const __m128i *)&line[x]);
+      __m128i upper = _mm_cmpgt_epi8 (addr, half);
+      __m128i out = _mm_or_si128 (
+          _mm_andnot_si128 (upper, _mm_shuffle_epi8 (low, addr)),
+          _mm_and_si128 (upper, _mm_shuffle_epi8 (high, addr)));
+      _mm_storeu_si128 ((__m128i *)&line[x], _mm_and_si128 (out, color));
+    }
+
+  for (; x < to; x++)
+    line[x] = PMEMORY.palette[line[x]] & mask;
+}
+#else
+static void
+ppu_palette_resolve (uint16_t from, uint16_t to)
+{
+  uint8_t *line = FRAME[PPU.curr_scanline];
+  uint8_t mask = MASK.grayscale ? MASK_GRAYSCALE : MASK_COLOR;
+
+  for (uint16_t x = from; x < to; x++)
+    line[x] = PMEMORY.palette[line[x]] & mask;
+}
+#endif
+
+// Line Rendering
+//
+// Renders the current line up to pixel `to' with the registers as they
+// are now. A whole untouched line takes the scanline path; anything
+// else (the pieces either side of a mid-line write) goes dot by dot.
+
+// Lines are not drawn in pipelined mode, where the render thread draws
+// them, nor while rendering is skipped; only sprite 0 hit is worked out.
+
+static inline bool
+ppu_drawing (void)
+{
+  return PPIPELINE == NULL && !RENDER_SKIP;
+}
+
+static void
+ppu_render_flush (uint16_t to)
+{
+  if (PPU.curr_scanline >= SCANLINE_VISIBLE || to <= PPU.render_x)
+    return;
+
+  if (!ppu_drawing ())
+    {
+      ppu_sprite_zero_probe (PPU.render_x, to);
+      PPU.render_x = to;
+      return;
+    }
+
+  if (PPU.render_x == 0 && to == FRAME_WIDTH)
+    ppu_render_scanline ();
+  else
+    ppu_render_dots (PPU.render_x, to);
+  ppu_sprite_composite (PPU.render_x, to);
+  ppu_palette_resolve (PPU.render_x, to);
+  EMPHASIS[PPU.curr_scanline]
+      = MASK.emph_red | MASK.emph_green << 1 | MASK.emph_blue << 2;
+  PPU.render_x = to;
+}
+
+// Called before a register write that changes how the rest of the line
+// is drawn: pixels already output keep the old registers.
+
+static inline void
+ppu_render_catch_up (void)
+{
+  uint16_t dot = PPU.curr_cycle;
+
+  ppu_render_flush (dot < FRAME_WIDTH ? dot : FRAME_WIDTH);
+}
+
+// Register Operations
+
+static inline void
+ppu_ctrl_set (uint8_t value)
+{
+  CTRL.nmi_enbl = value >> 7 & 1;
+  CTRL.master_slave = value >> 6 & 1;
+  CTRL.sprite_height = value >> 5 & 1;
+  CTRL.bg_pattern_addr = value >> 4 & 1;
+  CTRL.sprite_pattern_addr = value >> 3 & 1;
+  CTRL.increment_mode = value >> 2 & 1;
+  CTRL.nametbl_addr = value & 0x03;
+}
+
+static inline void
+ppu_mask_set (uint8_t value)
+{
+  MASK.emph_blue = value >> 7 & 1;
+  MASK.emph_green = value >> 6 & 1;
+  MASK.emph_red = value >> 5 & 1;
+  MASK.sprite_enbl = value >> 4 & 1;
+  MASK.bg_enbl = value >> 3 & 1;
+  MASK.sprite_lcol = value >> 2 & 1;
+  MASK.bg_lcol = value >> 1 & 1;
+  MASK.grayscale = value & 1;
+  PCONFIG.rendering_enbl = MASK.bg_enbl || MASK.sprite_enbl;
+}
+
+static inline void
+ppu_addr_increment (void)
+{
+  PPU.addr = (PPU.addr + (CTRL.increment_mode ? 32 : 1)) & MASK_PPU_ADDR;
+}
+
+static uint8_t
+ppu_reg_read (uint16_t reg)
+{
+  uint8_t value;
+
+  if (reg == PPUREG_STATUS || reg == PPUREG_DATA)
+    ppu_log (PPU_LOG_REG_READ, reg, 0, 0, 0, NULL);
+
+  switch (reg)
+    {
+    case PPUREG_STATUS:
+      ppu_render_catch_up ();
+      value = STATUS.vblank << 7 | STATUS.sprite_zero << 6
+              | STATUS.sprite_ovf << 5;
+      STATUS.vblank = 0;
+      PPU.write_latch = PPU.scroll_latch = PPU.addr_latch = false;
+      return value;
+    case PPUREG_OAMDATA:
+      return PMEMORY.oam[PPU.oam_addr];
+    case PPUREG_DATA:
+      value = PPU.data_buffer;
+      PPU.data_buffer = ppu_mem_read (PPU.addr);
+      if (PPU.addr >= PALETTE_BASE)
+        value = PPU.data_buffer;
+      ppu_addr_increment ();
+      return value;
+    default:
+      return 0;
+    }
+}
+
+static void
+ppu_reg_write (uint16_t reg, uint8_t value)
+{
+  ppu_log (PPU_LOG_REG_WRITE, reg, value, 0, 0, NULL);
+
+  switch (reg)
+    {
+    case PPUREG_CTRL:
+      ppu_render_catch_up ();
+      ppu_ctrl_set (value);
+      break;
+    case PPUREG_MASK:
+      ppu_render_catch_up ();
+      ppu_mask_set (value);
+      break;
+    case PPUREG_OMADDR:
+      PPU.oam_addr = value;
+      break;
+    case PPUREG_OAMDATA:
+      ppu_mem_mark (&PMEMORY.oam[PPU.oam_addr]);
+      PMEMORY.oam[PPU.oam_addr++] = value;
+      break;
+    case PPUREG_SCROLL:
+      ppu_render_catch_up ();
+      if (!PPU.scroll_latch)
+        {
+          PPU.scroll_x = value;
+          PPU.fine_x = value & MASK_FINE_X;
+        }
+      else
+        PPU.scroll_y = value;
+      PPU.scroll_latch = !PPU.scroll_latch;
+      break;
+    case PPUREG_ADDR:
+      // The high byte holds fine y (bits 4-5, bit 6 cleared), the
+      // nametable and coarse y bits 3-4; the low byte coarse y bits 0-2
+      // and coarse x
+      ppu_render_catch_up ();
+      if (!PPU.addr_latch)
+        {
+          PPU.addr = (value & 0x3F) << 8 | (PPU.addr & MASK_BYTE);
+          PPU.scroll_y = (PPU.scroll_y & 0x38) | (value & 0x03) << 6
+                         | (value >> 4 & 0x03);
+          CTRL.nametbl_addr = value >> 2 & 0x03;
+        }
+      else
+        {
+          PPU.addr = (PPU.addr & 0xFF00) | value;
+          PPU.scroll_x = (value & 0x1F) << 3 | (PPU.scroll_x & MASK_FINE_X);
+          PPU.scroll_y = (PPU.scroll_y & 0xC7) | (value >> 5) << 3;
+          if (PPU.curr_scanline < SCANLINE_VISIBLE)
+            {
+              // Dot 256 steps the copied y on to the next line
+              uint16_t y = ppu_bg_scroll_y () + (PPU.curr_cycle < FRAME_WIDTH);
+              uint16_t next = PPU.curr_scanline + 1;
+
+              PPU.origin_y
+                  = (y + FRAME_HEIGHT * 2 - next) % (FRAME_HEIGHT * 2);
+            }
+          else
+            PPU.origin_y = ppu_bg_scroll_y ();
+        }
+      PPU.addr_latch = !PPU.addr_latch;
+      break;
+    case PPUREG_DATA:
+      ppu_render_catch_up ();
+      ppu_mem_write (PPU.addr, value);
+      ppu_addr_increment ();
+      break;
+    }
+}
+
+// Host Access
+//
+// PPU memory as PPUDATA reaches it, for debuggers and checks, without
+// moving the address or the read buffer. A poke is not logged for the
+// render thread; call ppu_pipeline_resync after poking in pipelined
+// mode.
+
+uint8_t
+ppu_peek (uint16_t addr)
+{
+  return ppu_mem_read (addr);
+}
+
+void
+ppu_poke (uint16_t addr, uint8_t value)
+{
+  ppu_mem_write (addr, value);
+}
+
+// For hosts that copy into PMEMORY directly, such as when restoring a
+// snapshot: the decoded CHR RAM tiles are dropped, and the render
+// thread's shadow is copied over again at the end of the frame.
+
+void
+ppu_mem_restored (void)
+{
+  memset (CHR_CACHE.ram->valid, 0, sizeof (CHR_CACHE.ram->valid));
+  if (PPIPELINE != NULL)
+    PPIPELINE->resync = true;
+}
+
+// Frame Output
+//
+// FRAME stays in colour indices; the host's pixels are made only when
+// it asks for them, so a headless run never pays for them. Each line is
+// converted through the table of its emphasis mode. With SSSE3 a byte
+// plane is looked up 16 pixels at a time, a shuffle per quarter of the
+// 64 colours, and the planes are interleaved into pixels.
+
+// The 2C02 colours as RGB triples, used until a palette is loaded
+static const uint8_t PPU_PALETTE_2C02[PPU_COLORS * 3] = {
+  0x66, 0x66, 0x66, 0x00, 0x2A, 0x88, 0x14, 0x12, 0xA7, 0x3B, 0x00, 0xA4,
+  0x5C, 0x00, 0x7E, 0x6E, 0x00, 0x40, 0x6C, 0x06, 0x00, 0x56, 0x1D, 0x00,
+  0x33, 0x35, 0x00, 0x0B, 0x48, 0x00, 0x00, 0x52, 0x00, 0x00, 0x4F, 0x08,
+  0x00, 0x40, 0x4D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xAD, 0xAD, 0xAD, 0x15, 0x5F, 0xD9, 0x42, 0x40, 0xFF, 0x75, 0x27, 0xFE,
+  0xA0, 0x1A, 0xCC, 0xB7, 0x1E, 0x7B, 0xB5, 0x31, 0x20, 0x99, 0x4E, 0x00,
+  0x6B, 0x6D, 0x00, 0x38, 0x87, 0x00, 0x0C, 0x93, 0x00, 0x00, 0x8F, 0x32,
+  0x00, 0x7C, 0x8D, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xFF, 0xFE, 0xFF, 0x64, 0xB0, 0xFF, 0x92, 0x90, 0xFF, 0xC6, 0x76, 0xFF,
+  0xF3, 0x6A, 0xFF, 0xFE, 0x6E, 0xCC, 0xFE, 0x81, 0x70, 0xEA, 0x9E, 0x22,
+  0xBC, 0xBE, 0x00, 0x88, 0xD8, 0x00, 0x5C, 0xE4, 0x30, 0x45, 0xE0, 0x82,
+  0x48, 0xCD, 0xDE, 0x4F, 0x4F, 0x4F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0xFF, 0xFE, 0xFF, 0xC0, 0xDF, 0xFF, 0xD3, 0xD2, 0xFF, 0xE8, 0xC8, 0xFF,
+  0xFB, 0xC2, 0xFF, 0xFE, 0xC4, 0xEA, 0xFE, 0xCC, 0xC5, 0xF7, 0xD8, 0xA5,
+  0xE4, 0xE5, 0x94, 0xCF, 0xEF, 0x96, 0xBD, 0xF4, 0xAB, 0xB3, 0xF3, 0xCC,
+  0xB5, 0xEB, 0xF2, 0xB8, 0xB8, 0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Emphasis dims the channels it does not select to about 0.816
+#define PPU_EMPHASIS_DIM 209
+
+static const int PPU_FORMAT_BYTES[PPU_FORMATS] = { 4, 4, 2 };
+
+static void
+ppu_palette_set (ppu_palette_t *palette, int mode, int color,
+                 const uint8_t rgb[3])
+{
+  uint8_t r = rgb[0], g = rgb[1], b = rgb[2];
+  uint16_t rgb565 = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+  uint8_t *rgba8888 = palette->pixels[PPU_FORMAT_RGBA8888][mode][color];
+  uint8_t *bgra8888 = palette->pixels[PPU_FORMAT_BGRA8888][mode][color];
+
+  rgba8888[0] = bgra8888[2] = r;
+  rgba8888[1] = bgra8888[1] = g;
+  rgba8888[2] = bgra8888[0] = b;
+  rgba8888[3] = bgra8888[3] = MASK_BYTE;
+  memcpy (palette->pixels[PPU_FORMAT_RGB565][mode][color], &rgb565,
+          sizeof (rgb565));
+
+  for (int format = 0; format < PPU_FORMATS; format++)
+    for (int byte = 0; byte < 4; byte++)
+      palette->planes[format][mode][byte][color]
+          = palette->pixels[format][mode][color][byte];
+}
+
+// Fills `palette' from `entries' RGB triples (see ppu_palette_new).
+
+static void
+ppu_palette_build (ppu_palette_t *palette, const uint8_t *rgb,
+                   size_t entries)
+{
+  for (int mode = 0; mode < PPU_EMPHASIS_MODES; mode++)
+    for (int color = 0; color < PPU_COLORS; color++)
+      {
+        uint8_t out[3];
+
+        if (entries != PPU_COLORS)
+          memcpy (out, &rgb[(mode * PPU_COLORS + color) * 3], 3);
+        else
+          for (int c = 0; c < 3; c++)
+            {
+              out[c] = rgb[color * 3 + c];
+              if (mode & ~(1 << c))
+                out[c] = out[c] * PPU_EMPHASIS_DIM >> 8;
+            }
+        ppu_palette_set (palette, mode, color, out);
+      }
+}
+
+// The 2C02's colours, built once for the whole process and used by
+// every context that has not been given a palette of its own.
+
+static ppu_palette_t PPU_PALETTE_DEFAULT;
+static pthread_once_t PPU_PALETTE_DEFAULT_ONCE = PTHREAD_ONCE_INIT;
+
+static void
+ppu_palette_default_build (void)
+{
+  ppu_palette_build (&PPU_PALETTE_DEFAULT, PPU_PALETTE_2C02, PPU_COLORS);
+}
+
+static const ppu_palette_t *
+ppu_palette_default (void)
+{
+  pthread_once (&PPU_PALETTE_DEFAULT_ONCE, ppu_palette_default_build);
+  return &PPU_PALETTE_DEFAULT;
+}
+
+// A palette that any number of contexts can share, from `entries' RGB
+// triples: 64, from which the emphasis modes are derived, or 512, eight
+// sets of 64 in emphasis mode order as in a .pal file that has them.
+// Returns NULL for any other count, or if there is no memory for it.
+
+ppu_palette_t *
+ppu_palette_new (const uint8_t *rgb, size_t entries)
+{
+  ppu_palette_t *palette;
+
+  if (entries != PPU_COLORS && entries != PPU_EMPHASIS_MODES * PPU_COLORS)
+    return NULL;
+  palette = malloc (sizeof (*palette));
+  if (palette != NULL)
+    ppu_palette_build (palette, rgb, entries);
+  return palette;
+}
+
+void
+ppu_palette_free (ppu_palette_t *palette)
+{
+  free (palette);
+}
+
+// Gives the current PPU `palette', or the 2C02's colours if it is NULL.
+// The palette must outlive every context using it.
+
+void
+ppu_palette_use (const ppu_palette_t *palette)
+{
+  PPALETTE = palette != NULL ? palette : ppu_palette_default ();
+}
+
+#ifdef PPU_SIMD_SSSE3
+// A shuffle zeroes the lanes whose index has bit 7 set. Adding $70 with
+// saturation to the index, less the quarter's base, sets it in every
+// lane whose colour is outside the quarter and keeps bits 0-3 in the
+// others, so the four shuffles of a plane can be ORed together.
+
+static inline __m128i
+ppu_plane_lookup (const uint8_t plane[PPU_COLORS], const __m128i quarter[4])
+{
+  const __m128i *colors = (const __m128i *)plane;
+
+  return _mm_or_si128 (
+      _mm_or_si128 (
+          _mm_shuffle_epi8 (_mm_loadu_si128 (colors), quarter[0]),
+          _mm_shuffle_epi8 (_mm_loadu_si128 (colors + 1), quarter[1])),
+      _mm_or_si128 (
+          _mm_shuffle_epi8 (_mm_loadu_si128 (colors + 2), quarter[2]),
+          _mm_shuffle_epi8 (_mm_loadu_si128 (colors + 3), quarter[3])));
+}
+
+static inline void
+ppu_convert_line_bytes (uint8_t *dst, const uint8_t *line,
+                        const uint8_t (*planes)[PPU_COLORS], int bytes)
+{
+  const __m128i outside = _mm_set1_epi8 (0x70);
+
+  for (int x = 0; x < FRAME_WIDTH; x += 16)
+    {
+      __m128i idx = _mm_loadu_si128 ((const __m128i *)&line[x]);
+      const __m128i quarter[4] = {
+        _mm_adds_epu8 (idx, outside),
+        _mm_adds_epu8 (_mm_xor_si128 (idx, _mm_set1_epi8 (0x10)), outside),
+        _mm_adds_epu8 (_mm_xor_si128 (idx, _mm_set1_epi8 (0x20)), outside),
+        _mm_adds_epu8 (_mm_xor_si128 (idx, _mm_set1_epi8 (0x30)), outside),
+      };
+
+      __m128i p0 = ppu_plane_lookup (planes[0], quarter);
+      __m128i p1 = ppu_plane_lookup (planes[1], quarter);
+      __m128i lo01 = _mm_unpacklo_epi8 (p0, p1);
+      __m128i hi01 = _mm_unpackhi_epi8 (p0, p1);
+      __m128i *out = (__m128i *)&dst[x * bytes];
+
+      if (bytes == 2)
+        {
+          _mm_storeu_si128 (out, lo01);
+          _mm_storeu_si128 (out + 1, hi01);
+          continue;
+        }
+
+      __m128i p2 = ppu_plane_lookup (planes[2], quarter);
+      __m128i p3 = ppu_plane_lookup (planes[3], quarter);
+      __m128i lo23 = _mm_unpacklo_epi8 (p2, p3);
+      __m128i hi23 = _mm_unpackhi_epi8 (p2, p3);
+
+      _mm_storeu_si128 (out, _mm_unpacklo_epi16 (lo01, lo23));
+      _mm_storeu_si128 (out + 1, _mm_unpackhi_epi16 (lo01, lo23));
+      _mm_storeu_si128 (out + 2, _mm_unpacklo_epi16 (hi01, hi23));
+      _mm_storeu_si128 (out + 3, _mm_unpackhi_epi16 (hi01, hi23));
+    }
+}
+
+static void
+ppu_convert_line (uint8_t *dst, const uint8_t *line, int format, int mode)
+{
+  const uint8_t (*planes)[PPU_COLORS] = PPALETTE->planes[format][mode];
+
+  if (PPU_FORMAT_BYTES[format] == 2)
+    ppu_convert_line_bytes (dst, line, planes, 2);
+  else
+    ppu_convert_line_bytes (dst, line, planes, 4);
+}
+#else
+static void
+ppu_convert_line (uint8_t *dst, const uint8_t *line, int format, int mode)
+{
+  const uint8_t (*pixels)[4] = PPALETTE->pixels[format][mode];
+
+  if (PPU_FORMAT_BYTES[format] == 2)
+    for (int x = 0; x < FRAME_WIDTH; x++)
+      memcpy (&dst[x * 2], pixels[line[x]], 2);
+  else
+    for (int x = 0; x < FRAME_WIDTH; x++)
+      memcpy (&dst[x * 4], pixels[line[x]], 4);
+}
+#endif
+
+// Writes the current frame to `pixels' as FRAME_HEIGHT lines `pitch'
+// bytes apart, in one of the PPU_FORMAT_* layouts.
+
+void
+ppu_frame_convert (void *pixels, size_t pitch, int format)
+{
+  uint8_t *dst = pixels;
+
+  for (int y = 0; y < FRAME_HEIGHT; y++, dst += pitch)
+    ppu_convert_line (dst, FRAME[y], format, EMPHASIS[y]);
+}
+
+// The current frame as colour indices, FRAME_WIDTH per line, with the
+// emphasis mode of each line in `emphasis'. Hashing these describes the
+// picture without converting it.
+
+const uint8_t *
+ppu_frame_indices (const uint8_t **emphasis)
+{
+  *emphasis = EMPHASIS;
+  return &FRAME[0][0];
+}
+
+// Render Skip
+//
+// For runs that need the machine's state but few of its pictures. While
+// skipping, the PPU keeps its timing and everything the CPU can observe
+// (VBL, sprite overflow, sprite 0 hit) but draws nothing, and FRAME
+// keeps the last lines drawn. Set it before a frame starts to skip that
+// frame whole. In pipelined mode it applies to the render thread.
+
+void
+ppu_render_skip (bool skip)
+{
+  ppu_log (PPU_LOG_RENDER_SKIP, 0, skip, 0, 0, NULL);
+  RENDER_SKIP = skip;
+}
+
+// PPU Lifecycle
+
+void
+ppu_init (void)
+{
+  memset (&PPU, 0, sizeof (PPU));
+  memset (&PMEMORY, 0, sizeof (PMEMORY));
+  memset (FRAME, 0, sizeof (FRAME));
+  memset (EMPHASIS, 0, sizeof (EMPHASIS));
+  if (PPALETTE == NULL)
+    ppu_palette_use (NULL);
+  ppu_ctrl_set (0);
+  ppu_mask_set (0);
+  STATUS.vblank = STATUS.sprite_zero = STATUS.sprite_ovf = 0;
+  PPU.even_frame = true;
+  PCONFIG.vblank_supprsd = true;
+  ppu_mirroring_set (PPU_MIRROR_HORIZONTAL);
+  ppu_chr_cache_reset ();
+  if (PPIPELINE != NULL)
+    PPIPELINE->resync = true;
+}
+
+static void ppu_pipeline_frame_end (void);
+
+// Advances the PPU by one dot. Pixel x of a visible line is output on
+// dot x + 1, so the line is drawn once dot 256 has passed, unless a
+// register write already drew part of it.
+
+void
+ppu_step (void)
+{
+  if (PPU.curr_cycle == 0 && PPU.curr_scanline < SCANLINE_VISIBLE)
+    {
+      PCONFIG.sprite_zero_line = false;
+      PPU.sprite_count = 0;
+      if (PCONFIG.rendering_enbl)
+        ppu_sprite_evaluate ();
+      // Undrawn, the line is only needed for sprite 0 hit
+      if (ppu_drawing () || PCONFIG.sprite_zero_line)
+        ppu_sprite_line_build ();
+    }
+
+  if (PPU.curr_cycle == FRAME_WIDTH)
+    ppu_render_flush (FRAME_WIDTH);
+
+  if (PPU.curr_cycle == CYCLE_VERT_COPY
+      && PPU.curr_scanline == SCANLINE_FRAME_END && PCONFIG.rendering_enbl)
+    PPU.origin_y = ppu_bg_scroll_y ();
+
+  if (PPU.curr_cycle == 1)
+    {
+      if (PPU.curr_scanline == SCANLINE_VBLANK_START)
+        {
+          STATUS.vblank = !PCONFIG.vblank_supprsd;
+          PCONFIG.vblank_started = true;
+          PCONFIG.vblank_supprsd = false;
+        }
+      else if (PPU.curr_scanline == SCANLINE_FRAME_END)
+        {
+          STATUS.vblank = STATUS.sprite_zero = STATUS.sprite_ovf = 0;
+          PCONFIG.vblank_started = false;
+        }
+    }
+
+  if (++PPU.curr_cycle < CYCLES_PER_SCANLINE)
+    return;
+
+  PPU.curr_cycle = 0;
+  PPU.render_x = 0;
+  if (++PPU.curr_scanline > SCANLINE_FRAME_END)
+    {
+      PPU.curr_scanline = 0;
+      PPU.frame_count++;
+      PPU.even_frame = !PPU.even_frame;
+      if (PPIPELINE != NULL)
+        ppu_pipeline_frame_end ();
+    }
+}
+
+// Render Thread
+//
+// The render thread owns the shadow and replays one frame's log at a
+// time, stepping the shadow up to each input's dot and applying it with
+// the same functions, so it draws exactly what the emulating thread
+// would have. At the end of each frame the emulating thread waits for
+// the previous frame's replay, takes its picture into FRAME, and hands
+// over the new log: FRAME is always one frame behind.
+
+static void
+ppu_pipeline_apply (const ppu_log_entry_t *entry)
+{
+  switch (entry->kind)
+    {
+    case PPU_LOG_REG_WRITE:
+      ppu_reg_write (entry->reg, entry->value);
+      break;
+    case PPU_LOG_REG_READ:
+      ppu_reg_read (entry->reg);
+      break;
+    case PPU_LOG_MIRRORING:
+      ppu_mirroring_set (entry->value);
+      break;
+    case PPU_LOG_CHR_MAP:
+      ppu_chr_map (entry->window, entry->bytes, entry->bank);
+      break;
+    case PPU_LOG_RENDER_SKIP:
+      ppu_render_skip (entry->value);
+      break;
+    }
+}
+
+static void
+ppu_pipeline_replay (const ppu_log_t *log)
+{
+  size_t frame = PPU.frame_count;
+
+  for (size_t i = 0; i < log->count; i++)
+    {
+      const ppu_log_entry_t *entry = &log->entries[i];
+
+      while (ppu_dot () < entry->dot)
+        ppu_step ();
+      ppu_pipeline_apply (entry);
+    }
+
+  while (PPU.frame_count == frame)
+    ppu_step ();
+}
+
+static void *
+ppu_pipeline_thread (void *arg)
+{
+  ppu_pipeline_t *pipeline = arg;
+
+  ppu_context_select (pipeline->shadow);
+  pthread_mutex_lock (&pipeline->lock);
+  for (;;)
+    {
+      while (!pipeline->busy && !pipeline->quit)
+        pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+      if (!pipeline->busy)
+        break;
+
+      pthread_mutex_unlock (&pipeline->lock);
+      ppu_pipeline_replay (&pipeline->log[pipeline->replaying]);
+      pthread_mutex_lock (&pipeline->lock);
+
+      pipeline->busy = false;
+      pthread_cond_broadcast (&pipeline->cond);
+    }
+  pthread_mutex_unlock (&pipeline->lock);
+  return NULL;
+}
+
+// Makes the shadow a copy of the current PPU. Nametables, and CHR
+// windows on CHR RAM, are moved to the shadow's memory. The shadow keeps
+// a ROM store of its own, as both threads decode tiles, and keeps its
+// decoded tiles while the ROM stays the same.
+
+static uint8_t *
+ppu_pipeline_rebase (const ppu_context_t *ctx, ppu_context_t *shadow,
+                     uint8_t *bytes)
+{
+  const uint8_t *base = (const uint8_t *)&ctx->pmemory;
+
+  if (bytes < base || bytes >= base + sizeof (ctx->pmemory))
+    return bytes;
+  return (uint8_t *)&shadow->pmemory + (bytes - base);
+}
+
+static void
+ppu_pipeline_copy (ppu_pipeline_t *pipeline)
+{
+  ppu_context_t *ctx = ppu_context_current ();
+  ppu_context_t *shadow = pipeline->shadow;
+
+  const uint8_t *rom = shadow->chr_cache.rom;
+  size_t rom_size = shadow->chr_cache.rom_size;
+  ppu_chr_tile_t *rom_tiles = shadow->chr_cache.rom_tiles;
+  bool *rom_valid = shadow->chr_cache.rom_valid;
+  ppu_cold_t *cold = shadow->cold;
+
+  memcpy (shadow, ctx, sizeof (*shadow));
+  memcpy (cold, ctx->cold, sizeof (*cold));
+  shadow->pipeline = NULL;
+  shadow->cold = cold;
+  shadow->chr_cache.ram = &cold->chr_ram;
+  shadow->chr_cache.rom = rom;
+  shadow->chr_cache.rom_size = rom_size;
+  shadow->chr_cache.rom_tiles = rom_tiles;
+  shadow->chr_cache.rom_valid = rom_valid;
+  if (rom != ctx->chr_cache.rom || rom_size != ctx->chr_cache.rom_size)
+    ppu_chr_rom_store (&shadow->chr_cache, ctx->chr_cache.rom,
+                       ctx->chr_cache.rom_size);
+
+  for (int i = 0; i < 4; i++)
+    shadow->pconfig.nmtbl[i]
+        = ppu_pipeline_rebase (ctx, shadow, ctx->pconfig.nmtbl[i]);
+  for (int window = 0; window < CHR_WINDOWS; window++)
+    ppu_chr_window_set (&shadow->chr_cache, shadow->pmemory.chr_ram, window,
+                        ppu_pipeline_rebase (
+                            ctx, shadow, ctx->chr_cache.window_bytes[window]));
+}
+
+static void
+ppu_pipeline_frame_end (void)
+{
+  ppu_pipeline_t *pipeline = PPIPELINE;
+
+  pthread_mutex_lock (&pipeline->lock);
+  while (pipeline->busy)
+    pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+
+  memcpy (FRAME, pipeline->shadow->cold->frame, sizeof (FRAME));
+  memcpy (EMPHASIS, pipeline->shadow->cold->emphasis, sizeof (EMPHASIS));
+
+  if (pipeline->resync)
+    {
+      ppu_pipeline_copy (pipeline);
+      pipeline->resync = false;
+    }
+  else
+    {
+      pipeline->replaying = pipeline->filling;
+      pipeline->filling ^= 1;
+      pipeline->busy = true;
+      pthread_cond_broadcast (&pipeline->cond);
+    }
+  pipeline->log[pipeline->filling].count = 0;
+  pthread_mutex_unlock (&pipeline->lock);
+}
+
+static void
+ppu_pipeline_end (ppu_pipeline_t *pipeline)
+{
+  pthread_mutex_lock (&pipeline->lock);
+  pipeline->quit = true;
+  pthread_cond_broadcast (&pipeline->cond);
+  pthread_mutex_unlock (&pipeline->lock);
+  pthread_join (pipeline->thread, NULL);
+
+  pthread_cond_destroy (&pipeline->cond);
+  pthread_mutex_destroy (&pipeline->lock);
+  free (pipeline->log[0].entries);
+  free (pipeline->log[1].entries);
+  ppu_context_free (pipeline->shadow);
+  free (pipeline);
+}
+
+// Moves the rendering of the current PPU to a thread of its own. The
+// CPU-visible behaviour is unchanged; the frame read through
+// ppu_frame_convert or ppu_frame_indices is the one before the frame
+// just emulated. Returns false if the thread cannot be started.
+
+bool
+ppu_pipeline_start (void)
+{
+  ppu_pipeline_t *pipeline;
+
+  if (PPIPELINE != NULL)
+    return true;
+
+  pipeline = calloc (1, sizeof (*pipeline));
+  if (pipeline == NULL)
+    return false;
+
+  pipeline->shadow = ppu_context_new ();
+  for (int i = 0; i < 2; i++)
+    {
+      pipeline->log[i].capacity = PPU_LOG_INITIAL_SIZE;
+      pipeline->log[i].entries
+          = malloc (PPU_LOG_INITIAL_SIZE * sizeof (ppu_log_entry_t));
+    }
+  if (pipeline->shadow == NULL || pipeline->log[0].entries == NULL
+      || pipeline->log[1].entries == NULL)
+    goto fail;
+
+  ppu_pipeline_copy (pipeline);
+  pthread_mutex_init (&pipeline->lock, NULL);
+  pthread_cond_init (&pipeline->cond, NULL);
+  if (pthread_create (&pipeline->thread, NULL, ppu_pipeline_thread, pipeline)
+      != 0)
+    {
+      pthread_cond_destroy (&pipeline->cond);
+      pthread_mutex_destroy (&pipeline->lock);
+      goto fail;
+    }
+
+  PPIPELINE = pipeline;
+  return true;
+
+fail:
+  free (pipeline->log[0].entries);
+  free (pipeline->log[1].entries);
+  if (pipeline->shadow != NULL)
+    ppu_context_free (pipeline->shadow);
+  free (pipeline);
+  return false;
+}
+
+// Waits for the frame being rendered and brings rendering back to the
+// emulating thread, from the next line on.
+
+void
+ppu_pipeline_stop (void)
+{
+  if (PPIPELINE == NULL)
+    return;
+
+  ppu_pipeline_end (PPIPELINE);
+  PPIPELINE = NULL;
+}
+
+// For hosts that change the PPU's state other than through its inputs,
+// such as by loading a snapshot: the shadow is copied over again at the
+// end of the frame, whose picture is then lost.
+
+void
+ppu_pipeline_resync (void)
+{
+  if (PPIPELINE != NULL)
+    PPIPELINE->resync = true;
 }
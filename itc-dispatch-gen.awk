@@ -25,45 +25,115 @@ BEGIN {
     }
 
     gsub(/\*+/, "", cycles)
-   
+
+    for (i = 1; i <= 6; i++)
+	    flagstat[flags[i]] = "FLAGMODSTAT_UNMODIFIED"
+
     n_split = split(flagmod, flagmod_split, ",")
 
-    for (i = 1; i < n_split; i++) {
-	    if (flagmod_split[i] == flags[i] "=M7")
-		    flagstat[flags[i]] = "FLAGMODSTAT_M7"
-	    else if (flagmod_split[i] == flags[i] "=M6")
-		    flagstat[flags[i]] = "FLAGMODSTAT_M6"
-	    else if (flagmod_split[i] == flags[i] "=0")
-		    flagstat[flags[i]] = "FLAGMODSTAT_CLEARED"
-	    else if (flagmod_split[i] == flags[i] "=1")
-		    flagstat[flags[i]] = "FLAGMODSTAT_SET"
-	    else if (flagmod_split[i] == flags[i] "=-")
-		    flagstat[flags[i]] = "FLAGMODSTAT_CLEARED"
-	    else if (flagmod_split[i] == flags[i] "=+")
-		    flagstat[flags[i]] = "FLAGMODSTAT_MODIFIED"
+    for (i = 1; i <= n_split; i++) {
+	    split(flagmod_split[i], flagmod_pair, "=")
+
+	    if (flagmod_pair[2] == "M7")
+		    flagstat[flagmod_pair[1]] = "FLAGMODSTAT_M7"
+	    else if (flagmod_pair[2] == "M6")
+		    flagstat[flagmod_pair[1]] = "FLAGMODSTAT_M6"
+	    else if (flagmod_pair[2] == "0")
+		    flagstat[flagmod_pair[1]] = "FLAGMODSTAT_CLEARED"
+	    else if (flagmod_pair[2] == "1")
+		    flagstat[flagmod_pair[1]] = "FLAGMODSTAT_SET"
+	    else if (flagmod_pair[2] == "+")
+		    flagstat[flagmod_pair[1]] = "FLAGMODSTAT_MODIFIED"
 	    else {
-		    # UNREACHABLE
+		    # "-", UNMODIFIED
             }
+    }
+
+    seen[toupper(substr(opcode, 3))] = 1
 
+    # Stores, JMP and JSR use the address, never the byte at it, so they
+    # get the resolver that does not read it.
+    mode = map_addr_mode(addrmode)
+    if (mnemonic ~ /^(STA|STX|STY|JMP|JSR)$/ && mode ~ /^(zpg|abs|xind|yind)/)
+	mode = mode "_ea"
+
+    emit_opcode(opcode, mnemonic, mode,
+		"cpu_itc_" tolower(mnemonic), size, cycles, special)
+}
+
+# Every opcode the TSV does not describe gets a trap entry, so that the
+# table has no holes and the fetch never has to bounds-check it.
+END {
+    for (i = 1; i <= 6; i++)
+	    flagstat[flags[i]] = "FLAGMODSTAT_UNMODIFIED"
+
+    for (i = 0; i < 256; i++) {
+	    hex = sprintf("%02X", i)
+	    if (!(hex in seen))
+		    emit_opcode("0x" hex, "???", "impl",
+				"cpu_itc_trap", 1, 2, "SPECIALCASE_NONE")
     }
+}
 
-    emit_case(opcode, mnemonic, addrmode, size, cycles, special, flagstat)
+# emit=table (default) builds DISPATCH_TABLE, emit=info the DISPATCH_INFO
+# it leaves out, emit=labels and emit=handlers build the label table and
+# the fused handler bodies of the direct threaded core, emit=block_labels
+# and emit=block_handlers the same for the decoded block core, whose
+# operands come from the block instead of through PC.
+function emit_opcode(opcode, mnemonic, mode, itc, size, cycles, special) {
+    if (emit == "labels")
+	emit_label("dtc", opcode)
+    else if (emit == "handlers")
+	emit_handler("DTC", "cpu_addrmode_" mode " ()", itc, opcode, cycles,
+		     special)
+    else if (emit == "block_labels")
+	emit_label("blk", opcode)
+    else if (emit == "block_handlers")
+	emit_handler("BLK", "cpu_blockmode_" mode " (in->operand)", itc,
+		     opcode, cycles, special)
+    else if (emit == "info")
+	emit_info(opcode, mnemonic)
+    else
+	emit_entry(opcode, "cpu_addrmode_" mode, itc, size, cycles, special)
 }
 
-function emit_case(opcode, mnemonic, addrmode, size, cycles, special, flagstat) {
-    printf "\tcase %s:\n", opcode
-    printf "\t\tDISPATCH.mnemonic = \"%s\";\n", mnemonic
-    printf "\t\tDISPATCH.size_bytes = %s;\n", size
-    printf "\t\tDISPATCH.resolver = %s;\n", "cpu_addrmode_" map_addr_mode(addrmode)
-    printf "\t\tDISPATCH.num_cycles = %s;\n", cycles
-    printf "\t\tDISPATCH.itc_fn = %s;\n", "cpu_itc_" tolower(mnemonic)
-    printf "\t\tDISPATCH.special_case = %s;\n", special
-
-    for (flag in flagstat) {
-	printf "\t\tDISPATCH.action_%s = %s;\n", flag, flagstat[flag]
+function emit_label(prefix, opcode) {
+    printf "\t[%s] = &&%s_%s,\n", opcode, prefix, opcode
+}
+
+function emit_handler(prefix, resolve, itc, opcode, cycles, special) {
+    printf "    %s_HANDLER (%s)\n", prefix, opcode
+    printf "      %s;\n", resolve
+    printf "      cpu_operand_latch ();\n"
+    printf "      %s ();\n", itc
+    if (special == "SPECIALCASE_PAGE_CROSS")
+	printf "      CPU.total_cycles += %s + ADDR.page_crossed;\n", cycles
+    else
+	printf "      CPU.total_cycles += %s;\n", cycles
+    printf "      CPU.total_instrs++;\n"
+    printf "      %s_NEXT ();\n", prefix
+}
+
+function emit_entry(opcode, resolver, itc, size, cycles, special) {
+    printf "\t[%s] = {\n", opcode
+    printf "\t\t.resolver_fn = %s,\n", resolver
+    printf "\t\t.itc_fn = %s,\n", itc
+    printf "\t\t.opcode = %s,\n", opcode
+    printf "\t\t.size_bytes = %s,\n", size
+    printf "\t\t.num_cycles = %s,\n", cycles
+    printf "\t\t.special_case = %s,\n", special
+    printf "\t},\n"
+}
+
+function emit_info(opcode, mnemonic,    f) {
+    printf "\t[%s] = {\n", opcode
+    printf "\t\t.mnemonic = \"%s\",\n", mnemonic
+
+    for (f = 1; f <= 6; f++) {
+	printf "\t\t.action_%s = %s,\n", flags[f], flagstat[flags[f]]
     }
 
-    printf "\t\treturn;\n"
+    printf "\t},\n"
 }
 
 function map_addr_mode(mode) {
@@ -97,5 +167,3 @@ function map_addr_mode(mode) {
 	# UNREACHABLE
     }
 }
-
-
@@ -0,0 +1,593 @@
+// mapper-bench.c -- Bus access cost of the cartridge mappers
+//
+// Build (CPU.c and Mapper.c share a translation unit; the PPU is its
+// own, as usual):
+//
+//     m4 -P mapper-bench.c | cc -O2 -I. -x c - PPU.c -pthread -o mapper-bench
+//
+// Each mapper runs the same loop, which reads all four PRG windows,
+// writes RAM and PRG RAM, then switches banks through the mapper's
+// registers. It runs twice: once with the cartridge mapped through the
+// page table, as the emulator does, and once with every cartridge page
+// turned into MMIO, so that each access is a call, like a mapper with a
+// per-access cpu_read/cpu_write would be. Both runs must end in the
+// same machine state. The difference in time, over the number of
+// cartridge accesses counted in the second run, is the cost of a call.
+// Both runs use the direct threaded core: the block core cannot cache
+// code in MMIO, so it would fall back to stepping in the second run and
+// blur the difference.
+//
+// Before that, each mapper is checked against what the board does after
+// a few register writes. The exit status is non-zero if a check fails
+// or the two runs disagree.
+
+#include <time.h>
+
+m4_include(`CPU.c')m4_dnl
+m4_include(`Mapper.c')m4_dnl
+
+void ppu_init (void);
+uint8_t ppu_peek (uint16_t addr);
+void ppu_poke (uint16_t addr, uint8_t value);
+
+#define BENCH_CYCLES 50000000ULL
+#define BENCH_PRG_BANK 0x2000
+#define BENCH_PRG_SIZE 0x20000
+#define BENCH_CHR_SIZE 0x10000
+#define BENCH_CODE_OFFSET 0x1000
+#define BENCH_ORIGIN 0xF000
+#define BENCH_CART_BEGIN 0x6000
+
+// The loop, placed at $x000 of every 8 KiB PRG bank so that it keeps
+// running whichever bank ends up at $E000. The bank switch sequence is
+// patched in at BENCH_SWITCH and followed by the JMP back.
+
+static const uint8_t BENCH_LOOP[] = {
+  0xA2, 0x00,       // $F000  LDX #$00        start
+  0xBD, 0x00, 0x80, // $F002  LDA $8000,X     loop
+  0x7D, 0x00, 0xA0, // $F005  ADC $A000,X
+  0x7D, 0x00, 0xC0, // $F008  ADC $C000,X
+  0x7D, 0x00, 0xE0, // $F00B  ADC $E000,X
+  0x9D, 0x00, 0x02, // $F00E  STA $0200,X
+  0x9D, 0x00, 0x60, // $F011  STA $6000,X
+  0xE8,             // $F014  INX
+  0xD0, 0xEB,       // $F015  BNE $F002
+  0xE6, 0x10,       // $F017  INC $10
+  0xA5, 0x10,       // $F019  LDA $10
+};
+
+#define BENCH_SWITCH sizeof (BENCH_LOOP)
+
+// STA $8000
+static const uint8_t BENCH_SWITCH_LATCH[] = { 0x8D, 0x00, 0x80 };
+
+// Five serial writes of A into the PRG register at $E000
+static const uint8_t BENCH_SWITCH_MMC1[] = {
+  0x8D, 0x00, 0xE0, 0x4A, 0x8D, 0x00, 0xE0, 0x4A, 0x8D, 0x00,
+  0xE0, 0x4A, 0x8D, 0x00, 0xE0, 0x4A, 0x8D, 0x00, 0xE0,
+};
+
+// A into R6, R7 (PRG) and R2 (CHR)
+static const uint8_t BENCH_SWITCH_MMC3[] = {
+  0xA0, 0x06, 0x8C, 0x00, 0x80, 0x8D, 0x01, 0x80,
+  0xA0, 0x07, 0x8C, 0x00, 0x80, 0x8D, 0x01, 0x80,
+  0xA0, 0x02, 0x8C, 0x00, 0x80, 0x8D, 0x01, 0x80,
+};
+
+typedef struct
+{
+  uint16_t id;
+  uint32_t prg_size;
+  bool chr_rom;
+  const uint8_t *switch_code;
+  size_t switch_size;
+} bench_case_t;
+
+static const bench_case_t BENCH_CASES[] = {
+  { 0, 0x8000, true, BENCH_SWITCH_LATCH, sizeof (BENCH_SWITCH_LATCH) },
+  { 1, BENCH_PRG_SIZE, true, BENCH_SWITCH_MMC1, sizeof (BENCH_SWITCH_MMC1) },
+  { 2, BENCH_PRG_SIZE, false, BENCH_SWITCH_LATCH,
+    sizeof (BENCH_SWITCH_LATCH) },
+  { 3, 0x8000, true, BENCH_SWITCH_LATCH, sizeof (BENCH_SWITCH_LATCH) },
+  { 4, BENCH_PRG_SIZE, true, BENCH_SWITCH_MMC3, sizeof (BENCH_SWITCH_MMC3) },
+  { 7, BENCH_PRG_SIZE, false, BENCH_SWITCH_LATCH,
+    sizeof (BENCH_SWITCH_LATCH) },
+};
+
+static uint8_t BENCH_PRG[BENCH_PRG_SIZE];
+static uint8_t BENCH_CHR[BENCH_CHR_SIZE];
+
+static void
+bench_build_rom (const bench_case_t *c)
+{
+  for (uint32_t bank = 0; bank < c->prg_size / BENCH_PRG_BANK; bank++)
+    {
+      uint8_t *base = &BENCH_PRG[bank * BENCH_PRG_BANK];
+      uint8_t *code = base + BENCH_CODE_OFFSET;
+
+      for (uint32_t i = 0; i < BENCH_PRG_BANK; i++)
+        base[i] = bank * 7 + i;
+
+      memcpy (code, BENCH_LOOP, sizeof (BENCH_LOOP));
+      memcpy (code + BENCH_SWITCH, c->switch_code, c->switch_size);
+      code[BENCH_SWITCH + c->switch_size] = 0x4C; // JMP $F000
+      code[BENCH_SWITCH + c->switch_size + 1] = BENCH_ORIGIN & MASK_BYTE;
+      code[BENCH_SWITCH + c->switch_size + 2] = BENCH_ORIGIN >> 8;
+
+      for (int v = 0; v < 6; v += 2)
+        {
+          base[BENCH_PRG_BANK - 6 + v] = BENCH_ORIGIN & MASK_BYTE;
+          base[BENCH_PRG_BANK - 5 + v] = BENCH_ORIGIN >> 8;
+        }
+    }
+
+  for (uint32_t i = 0; i < BENCH_CHR_SIZE; i++)
+    BENCH_CHR[i] = i >> 10;
+}
+
+// Called Mode
+//
+// The cartridge pages become MMIO whose handlers read and write through
+// a copy of the page table taken after every mapper write.
+
+static uint8_t *BENCH_SHADOW_READ[NUM_PAGES];
+static uint8_t *BENCH_SHADOW_WRITE[NUM_PAGES];
+static uint64_t BENCH_CALLS;
+
+static uint8_t bench_called_read (uint16_t addr);
+static void bench_called_write (uint16_t addr, uint8_t val);
+
+static void
+bench_shadow_capture (void)
+{
+  memcpy (BENCH_SHADOW_READ, MEMORY.read_page, sizeof (BENCH_SHADOW_READ));
+  memcpy (BENCH_SHADOW_WRITE, MEMORY.write_page, sizeof (BENCH_SHADOW_WRITE));
+  cpu_mem_map_mmio (BENCH_CART_BEGIN, 0xFFFF, bench_called_read,
+                    bench_called_write);
+}
+
+static uint8_t
+bench_called_read (uint16_t addr)
+{
+  BENCH_CALLS++;
+  return BENCH_SHADOW_READ[GET_PAGE (addr)][addr & MASK_BYTE];
+}
+
+static void
+bench_called_write (uint16_t addr, uint8_t val)
+{
+  uint8_t *page = BENCH_SHADOW_WRITE[GET_PAGE (addr)];
+
+  BENCH_CALLS++;
+  if (page != NULL)
+    {
+      page[addr & MASK_BYTE] = val;
+      return;
+    }
+
+  // The mapper remaps only the pages it switches, so put the others
+  // back before taking the copy again
+  memcpy (MEMORY.read_page, BENCH_SHADOW_READ, sizeof (BENCH_SHADOW_READ));
+  memcpy (MEMORY.write_page, BENCH_SHADOW_WRITE, sizeof (BENCH_SHADOW_WRITE));
+  mapper_cpu_write (addr, val);
+  bench_shadow_capture ();
+}
+
+// Checks
+//
+// Each check resets a mapper with the header's mirroring, writes its
+// registers through the bus and compares what the board then shows: the
+// 8 KiB PRG bank in each CPU window (every PRG byte holds bank * 7 plus
+// its offset), the 1 KiB CHR bank in each PPU window (every CHR byte
+// holds its bank), the nametable layout, and how many A12 clocks are
+// left before the IRQ, which is then clocked up to and past. Before the
+// reset the first byte of CIRAM's two tables is marked, so the layout
+// shows in what the four logical tables read.
+
+typedef struct
+{
+  uint16_t addr;
+  uint8_t val;
+} bench_write_t;
+
+typedef struct
+{
+  const char *name;
+  uint16_t id;
+  uint32_t prg_size;
+  bool chr_rom;
+  int mirroring;
+  const bench_write_t *writes;
+  size_t num_writes;
+  int prg[4];
+  int chr[MAPPER_CHR_WINDOWS];
+  int mode;
+  int irq;
+} bench_check_t;
+
+#define BENCH_CIRAM_A 0xAA
+#define BENCH_CIRAM_B 0xBB
+
+static const struct
+{
+  int mode;
+  const char *name;
+  uint8_t reads[4];
+} BENCH_LAYOUTS[] = {
+  { PPU_MIRROR_HORIZONTAL, "horizontal", { 0xAA, 0xAA, 0xBB, 0xBB } },
+  { PPU_MIRROR_VERTICAL, "vertical", { 0xAA, 0xBB, 0xAA, 0xBB } },
+  { PPU_MIRROR_SINGLE_A, "single A", { 0xAA, 0xAA, 0xAA, 0xAA } },
+  { PPU_MIRROR_SINGLE_B, "single B", { 0xBB, 0xBB, 0xBB, 0xBB } },
+  { PPU_MIRROR_FOUR_SCREEN, "four-screen", { 0xAA, 0xBB, 0x00, 0x00 } },
+};
+
+#define BENCH_NUM_LAYOUTS (sizeof (BENCH_LAYOUTS) / sizeof (BENCH_LAYOUTS[0]))
+
+#define BENCH_WRITES(w) w, sizeof (w) / sizeof (w[0])
+
+// The five serial writes that load `v' into the MMC1 register at `a'
+#define BENCH_MMC1(a, v)                                                      \
+  { a, (v) & 1 }, { a, (v) >> 1 & 1 }, { a, (v) >> 2 & 1 },                   \
+      { a, (v) >> 3 & 1 }, { a, (v) >> 4 & 1 }
+
+#define BENCH_LINEAR_CHR { 0, 1, 2, 3, 4, 5, 6, 7 }
+#define BENCH_NO_CHR { 0 }
+
+static const bench_write_t BENCH_NO_WRITES[] = { { 0x6000, 0 } };
+static const bench_write_t BENCH_UXROM_BANK[] = { { 0x8000, 5 } };
+static const bench_write_t BENCH_CNROM_BANK[] = { { 0x8000, 3 } };
+static const bench_write_t BENCH_MMC1_VERTICAL[] = {
+  BENCH_MMC1 (0x8000, 0x02),
+};
+static const bench_write_t BENCH_MMC1_BANKS[] = {
+  BENCH_MMC1 (0x8000, 0x1F), BENCH_MMC1 (0xA000, 5),
+  BENCH_MMC1 (0xC000, 9), BENCH_MMC1 (0xE000, 6),
+};
+static const bench_write_t BENCH_MMC1_RESET[] = {
+  BENCH_MMC1 (0x8000, 0x02), { 0x8000, 0x00 }, { 0x8000, 0x80 },
+};
+static const bench_write_t BENCH_MMC3_HORIZONTAL[] = { { 0xA000, 0x01 } };
+static const bench_write_t BENCH_MMC3_BANKS[] = {
+  { 0x8000, 0x46 }, { 0x8001, 3 },  { 0x8000, 0x47 }, { 0x8001, 5 },
+  { 0x8000, 0x40 }, { 0x8001, 8 },  { 0x8000, 0x41 }, { 0x8001, 11 },
+  { 0x8000, 0x42 }, { 0x8001, 20 }, { 0x8000, 0x43 }, { 0x8001, 21 },
+  { 0x8000, 0x44 }, { 0x8001, 22 }, { 0x8000, 0xC5 }, { 0x8001, 23 },
+};
+static const bench_write_t BENCH_MMC3_IRQ[] = {
+  { 0xC000, 20 }, { 0xC001, 0 }, { 0xE001, 0 },
+};
+static const bench_write_t BENCH_MMC3_IRQ_OFF[] = {
+  { 0xC000, 20 }, { 0xC001, 0 }, { 0xE001, 0 }, { 0xE000, 0 },
+};
+static const bench_write_t BENCH_AXROM_PAGE[] = { { 0x8000, 0x13 } };
+
+static const bench_check_t BENCH_CHECKS[] = {
+  { "NROM vertical", 0, 0x8000, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 1, 2, 3 }, BENCH_LINEAR_CHR,
+    PPU_MIRROR_VERTICAL, -1 },
+  { "NROM-128", 0, 0x4000, true, PPU_MIRROR_HORIZONTAL,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 1, 0, 1 }, BENCH_LINEAR_CHR,
+    PPU_MIRROR_HORIZONTAL, -1 },
+  { "UxROM reset", 2, BENCH_PRG_SIZE, false, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 1, 14, 15 }, BENCH_NO_CHR,
+    PPU_MIRROR_VERTICAL, -1 },
+  { "UxROM bank", 2, BENCH_PRG_SIZE, false, PPU_MIRROR_HORIZONTAL,
+    BENCH_WRITES (BENCH_UXROM_BANK), { 10, 11, 14, 15 }, BENCH_NO_CHR,
+    PPU_MIRROR_HORIZONTAL, -1 },
+  { "CNROM four-screen", 3, 0x8000, true, PPU_MIRROR_FOUR_SCREEN,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 1, 2, 3 }, BENCH_LINEAR_CHR,
+    PPU_MIRROR_FOUR_SCREEN, -1 },
+  { "CNROM bank", 3, 0x8000, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_CNROM_BANK), { 0, 1, 2, 3 },
+    { 24, 25, 26, 27, 28, 29, 30, 31 }, PPU_MIRROR_VERTICAL, -1 },
+  { "MMC1 reset", 1, BENCH_PRG_SIZE, true, PPU_MIRROR_HORIZONTAL,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 1, 14, 15 }, BENCH_LINEAR_CHR,
+    PPU_MIRROR_SINGLE_A, -1 },
+  { "MMC1 control", 1, BENCH_PRG_SIZE, true, PPU_MIRROR_HORIZONTAL,
+    BENCH_WRITES (BENCH_MMC1_VERTICAL), { 0, 1, 2, 3 }, BENCH_LINEAR_CHR,
+    PPU_MIRROR_VERTICAL, -1 },
+  { "MMC1 banks", 1, BENCH_PRG_SIZE, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_MMC1_BANKS), { 12, 13, 14, 15 },
+    { 20, 21, 22, 23, 36, 37, 38, 39 }, PPU_MIRROR_HORIZONTAL, -1 },
+  { "MMC1 shift reset", 1, BENCH_PRG_SIZE, true, PPU_MIRROR_HORIZONTAL,
+    BENCH_WRITES (BENCH_MMC1_RESET), { 0, 1, 14, 15 }, BENCH_LINEAR_CHR,
+    PPU_MIRROR_VERTICAL, -1 },
+  { "MMC3 reset", 4, BENCH_PRG_SIZE, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 0, 14, 15 },
+    { 0, 1, 0, 1, 0, 0, 0, 0 }, PPU_MIRROR_VERTICAL, -1 },
+  { "MMC3 $A000", 4, BENCH_PRG_SIZE, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_MMC3_HORIZONTAL), { 0, 0, 14, 15 },
+    { 0, 1, 0, 1, 0, 0, 0, 0 }, PPU_MIRROR_HORIZONTAL, -1 },
+  { "MMC3 four-screen", 4, BENCH_PRG_SIZE, true, PPU_MIRROR_FOUR_SCREEN,
+    BENCH_WRITES (BENCH_MMC3_HORIZONTAL), { 0, 0, 14, 15 },
+    { 0, 1, 0, 1, 0, 0, 0, 0 }, PPU_MIRROR_FOUR_SCREEN, -1 },
+  { "MMC3 banks", 4, BENCH_PRG_SIZE, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_MMC3_BANKS), { 14, 5, 3, 15 },
+    { 20, 21, 22, 23, 8, 9, 10, 11 }, PPU_MIRROR_VERTICAL, -1 },
+  { "MMC3 IRQ", 4, BENCH_PRG_SIZE, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_MMC3_IRQ), { 0, 0, 14, 15 },
+    { 0, 1, 0, 1, 0, 0, 0, 0 }, PPU_MIRROR_VERTICAL, 21 },
+  { "MMC3 IRQ off", 4, BENCH_PRG_SIZE, true, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_MMC3_IRQ_OFF), { 0, 0, 14, 15 },
+    { 0, 1, 0, 1, 0, 0, 0, 0 }, PPU_MIRROR_VERTICAL, -1 },
+  { "AxROM reset", 7, BENCH_PRG_SIZE, false, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_NO_WRITES), { 0, 1, 2, 3 }, BENCH_NO_CHR,
+    PPU_MIRROR_SINGLE_A, -1 },
+  { "AxROM page", 7, BENCH_PRG_SIZE, false, PPU_MIRROR_VERTICAL,
+    BENCH_WRITES (BENCH_AXROM_PAGE), { 12, 13, 14, 15 }, BENCH_NO_CHR,
+    PPU_MIRROR_SINGLE_B, -1 },
+};
+
+static int
+bench_layout (void)
+{
+  uint8_t reads[4];
+
+  for (int i = 0; i < 4; i++)
+    reads[i] = ppu_peek (0x2000 + i * 0x0400);
+  for (size_t i = 0; i < BENCH_NUM_LAYOUTS; i++)
+    if (memcmp (reads, BENCH_LAYOUTS[i].reads, sizeof (reads)) == 0)
+      return BENCH_LAYOUTS[i].mode;
+  return -1;
+}
+
+static const char *
+bench_layout_name (int mode)
+{
+  for (size_t i = 0; i < BENCH_NUM_LAYOUTS; i++)
+    if (BENCH_LAYOUTS[i].mode == mode)
+      return BENCH_LAYOUTS[i].name;
+  return "?";
+}
+
+static void
+bench_check_print (const char *name, const int prg[4], const int *chr,
+                   int mode, int irq, const char *verdict)
+{
+  printf ("%-18s prg %2d %2d %2d %2d  chr ", name, prg[0], prg[1], prg[2],
+          prg[3]);
+  if (chr != NULL)
+    for (int i = 0; i < MAPPER_CHR_WINDOWS; i++)
+      printf ("%2d ", chr[i]);
+  else
+    printf ("%-24s", "RAM");
+  printf (" %-11s irq %3d%s\n", bench_layout_name (mode), irq, verdict);
+}
+
+static bool
+bench_check (const bench_check_t *c)
+{
+  bench_case_t rom = { c->id, c->prg_size, c->chr_rom, BENCH_SWITCH_LATCH,
+                       sizeof (BENCH_SWITCH_LATCH) };
+  int prg[4], chr[MAPPER_CHR_WINDOWS];
+
+  bench_build_rom (&rom);
+  cpu_init ();
+  ppu_init ();
+  ppu_poke (0x2000, BENCH_CIRAM_A);
+  ppu_poke (0x2800, BENCH_CIRAM_B);
+
+  mapper_t *m = mapper_new (c->id, BENCH_PRG, c->prg_size,
+                            c->chr_rom ? BENCH_CHR : NULL, BENCH_CHR_SIZE,
+                            c->mirroring);
+  if (m == NULL)
+    return false;
+  mapper_reset (m);
+
+  // MMC1 ignores a write on the cycle after another
+  for (size_t i = 0; i < c->num_writes; i++, CPU.total_cycles += 2)
+    cpu_mem_write_byte (c->writes[i].addr, c->writes[i].val);
+
+  for (int slot = 0; slot < 4; slot++)
+    prg[slot] = cpu_mem_read_byte (MAPPER_PRG_BEGIN + slot * BENCH_PRG_BANK)
+                / 7;
+  for (int window = 0; window < MAPPER_CHR_WINDOWS; window++)
+    chr[window] = ppu_peek (window * MAPPER_CHR_WINDOW);
+  int mode = bench_layout ();
+  int irq = mapper_irq_clocks (m);
+
+  bool ok = memcmp (prg, c->prg, sizeof (prg)) == 0
+            && (!c->chr_rom || memcmp (chr, c->chr, sizeof (chr)) == 0)
+            && mode == c->mode && irq == c->irq;
+
+  // The IRQ comes on the predicted clock, not one before
+  if (c->irq > 0)
+    {
+      mapper_clock (m, c->irq - 1);
+      bool early = CPU.pending_IRQ;
+      mapper_clock (m, 1);
+      ok = ok && !early && CPU.pending_IRQ;
+    }
+
+  bench_check_print (c->name, prg, c->chr_rom ? chr : NULL, mode, irq,
+                     ok ? "  ok" : "  MISMATCH");
+  if (!ok)
+    bench_check_print ("  want", c->prg, c->chr_rom ? c->chr : NULL, c->mode,
+                       c->irq, "");
+  mapper_free (m);
+  return ok;
+}
+
+// MMC3 raises its IRQ, another source raises its own, and $E000
+// acknowledges the MMC3's alone: the line stays asserted for the other.
+
+static bool
+bench_irq_line (void)
+{
+  bench_case_t rom = { 4, BENCH_PRG_SIZE, true, BENCH_SWITCH_LATCH,
+                       sizeof (BENCH_SWITCH_LATCH) };
+
+  bench_build_rom (&rom);
+  cpu_init ();
+  ppu_init ();
+
+  mapper_t *m = mapper_new (4, BENCH_PRG, BENCH_PRG_SIZE, BENCH_CHR,
+                            BENCH_CHR_SIZE, PPU_MIRROR_VERTICAL);
+  if (m == NULL)
+    return false;
+  mapper_reset (m);
+
+  cpu_mem_write_byte (0xC000, 0);
+  cpu_mem_write_byte (0xC001, 0);
+  cpu_mem_write_byte (0xE001, 0);
+  mapper_clock (m, 1);
+  bool raised = CPU.irq_lines == CPU_IRQ_MAPPER && CPU.pending_IRQ;
+
+  cpu_irq_set (CPU_IRQ_FRAME, true);
+  cpu_mem_write_byte (0xE000, 0);
+  bool shared = CPU.irq_lines == CPU_IRQ_FRAME && CPU.pending_IRQ;
+
+  cpu_irq_set (CPU_IRQ_FRAME, false);
+  bool released = !CPU.pending_IRQ;
+  bool ok = raised && shared && released;
+
+  printf ("%-18s raised %s, kept for frame IRQ %s, released %s%s\n",
+          "MMC3 IRQ line", raised ? "yes" : "no", shared ? "yes" : "no",
+          released ? "yes" : "no", ok ? "  ok" : "  MISMATCH");
+  mapper_free (m);
+  return ok;
+}
+
+// INC $FFFA writes the $00 it read and then $01 on the next cycle; MMC1
+// takes the first and ignores the second, so the bit shifted in is 0.
+
+static bool
+bench_mmc1_rmw (void)
+{
+  static const uint8_t inc[] = { 0xEE, 0xFA, 0xFF }; // INC $FFFA
+  bench_case_t rom = { 1, BENCH_PRG_SIZE, true, BENCH_SWITCH_LATCH,
+                       sizeof (BENCH_SWITCH_LATCH) };
+
+  bench_build_rom (&rom);
+  cpu_init ();
+  ppu_init ();
+
+  mapper_t *m = mapper_new (1, BENCH_PRG, BENCH_PRG_SIZE, BENCH_CHR,
+                            BENCH_CHR_SIZE, PPU_MIRROR_VERTICAL);
+  if (m == NULL)
+    return false;
+  mapper_reset (m);
+
+  for (size_t i = 0; i < sizeof (inc); i++)
+    cpu_mem_write_byte (i, inc[i]);
+  CPU.pending_RESET = false;
+  CPU.PC = 0;
+  cpu_step ();
+  for (int bit = 1; bit < 5; bit++, CPU.total_cycles += 2)
+    cpu_mem_write_byte (0xE000, (6 >> bit) & 1);
+
+  int bank = cpu_mem_read_byte (MAPPER_PRG_BEGIN) / 7;
+  bool ok = bank == 12;
+
+  printf ("%-18s PRG bank %d%s\n", "MMC1 INC", bank,
+          ok ? "  ok" : "  MISMATCH");
+  mapper_free (m);
+  return ok;
+}
+
+static bool
+bench_checks (void)
+{
+  size_t checked = sizeof (BENCH_CHECKS) / sizeof (BENCH_CHECKS[0]) + 2;
+  unsigned failed = 0;
+
+  for (size_t i = 0; i < sizeof (BENCH_CHECKS) / sizeof (BENCH_CHECKS[0]);
+       i++)
+    failed += !bench_check (&BENCH_CHECKS[i]);
+  failed += !bench_irq_line ();
+  failed += !bench_mmc1_rmw ();
+
+  printf ("%zu checks, %u failed\n\n", checked, failed);
+  return failed == 0;
+}
+
+// Runs
+
+typedef struct
+{
+  uint8_t ACC;
+  uint64_t total_cycles;
+  uint64_t total_instrs;
+  uint8_t ram[PAGE_SIZE];
+  uint8_t prg_ram[PAGE_SIZE];
+} bench_state_t;
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_run (mapper_t *m, bool called, bench_state_t *state)
+{
+  memset (state, 0, sizeof (*state));
+  cpu_init ();
+  memset (MEMORY.ram, 0, sizeof (MEMORY.ram));
+  ppu_init ();
+  memset (m->prg_ram, 0, sizeof (m->prg_ram));
+  mapper_reset (m);
+  if (called)
+    bench_shadow_capture ();
+  BENCH_CALLS = 0;
+
+  double begin = bench_now ();
+  cpu_run_direct (BENCH_CYCLES);
+  double elapsed = bench_now () - begin;
+
+  state->ACC = CPU.ACC;
+  state->total_cycles = CPU.total_cycles;
+  state->total_instrs = CPU.total_instrs;
+  memcpy (state->ram, &MEMORY.ram[0x0200], PAGE_SIZE);
+  memcpy (state->prg_ram, m->prg_ram, PAGE_SIZE);
+  return elapsed;
+}
+
+int
+main (void)
+{
+  if (!bench_checks ())
+    return EXIT_FAILURE;
+
+  printf ("%-6s %12s %12s %10s %10s %8s\n", "mapper", "cycles",
+          "cart calls", "mapped", "called", "ns/call");
+
+  for (size_t i = 0; i < sizeof (BENCH_CASES) / sizeof (BENCH_CASES[0]);
+       i++)
+    {
+      const bench_case_t *c = &BENCH_CASES[i];
+      bench_state_t mapped_state, called_state;
+
+      bench_build_rom (c);
+      mapper_t *m = mapper_new (c->id, BENCH_PRG, c->prg_size,
+                                c->chr_rom ? BENCH_CHR : NULL,
+                                BENCH_CHR_SIZE, PPU_MIRROR_HORIZONTAL);
+      if (m == NULL)
+        {
+          fprintf (stderr, "mapper %u is not in the table\n", c->id);
+          return EXIT_FAILURE;
+        }
+
+      double mapped = bench_run (m, false, &mapped_state);
+      double called = bench_run (m, true, &called_state);
+
+      if (memcmp (&mapped_state, &called_state, sizeof (mapped_state)) != 0)
+        {
+          fprintf (stderr, "%s: runs disagree on the final machine state\n",
+                   m->ops->name);
+          return EXIT_FAILURE;
+        }
+
+      printf ("%-6s %12llu %12llu %7.1f Mc/s %5.1f Mc/s %8.2f\n",
+              m->ops->name, (unsigned long long)mapped_state.total_cycles,
+              (unsigned long long)BENCH_CALLS,
+              mapped_state.total_cycles / mapped / 1e6,
+              called_state.total_cycles / called / 1e6,
+              (called - mapped) / BENCH_CALLS * 1e9);
+      mapper_free (m);
+    }
+
+  return EXIT_SUCCESS;
+}
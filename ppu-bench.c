@@ -0,0 +1,318 @@
+// ppu-bench.c -- Frame cost of the PPU, and a check of what it draws
+//
+// Build (PPU.c is included, so that its registers and state can be
+// reached without the CPU's bus):
+//
+//     cc -O2 -I. ppu-bench.c -pthread -o ppu-bench
+//
+// Add -DPPU_NO_SIMD to check and time the scalar paths.
+//
+// First come the checks, each a small scene run for a frame and its
+// result compared with what the console shows; then a busy scene is
+// timed drawn and with rendering skipped. The exit status is non-zero
+// if any check fails, so the bench doubles as a conformance check.
+
+#include "PPU.c"
+
+#include <time.h>
+
+#define BENCH_FRAMES 600
+#define BENCH_SOLID_TILE 1
+#define BENCH_BACKDROP 0x0F
+#define BENCH_SPRITE_COLOR 0x30
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_frame (void)
+{
+  size_t frame = PPU.frame_count;
+
+  while (PPU.frame_count == frame)
+    ppu_step ();
+}
+
+// A blank scene on CHR RAM: tile 1 solid, and in the high pattern table
+// tile 0 too, so that an 8x16 sprite of tile 1 is solid whole; every
+// sprite hidden below the picture, and background and sprites shown in
+// all columns. SOLID_BG fills the first nametable with tile 1.
+
+static void
+bench_scene (bool solid_bg)
+{
+  ppu_init ();
+  for (int window = 0; window < CHR_WINDOWS; window++)
+    ppu_chr_map (window, NULL, window);
+
+  for (int i = 0; i < TILE_SIZE; i++)
+    {
+      ppu_mem_write (BENCH_SOLID_TILE * 16 + i, 0xFF);
+      ppu_mem_write (PATTERN_TABLE_HI + i, 0xFF);
+      ppu_mem_write (PATTERN_TABLE_HI + BENCH_SOLID_TILE * 16 + i, 0xFF);
+    }
+  if (solid_bg)
+    for (int i = 0; i < NMTBL_ATTR_OFFSET; i++)
+      ppu_mem_write (NMTBL_BASE + i, BENCH_SOLID_TILE);
+
+  ppu_mem_write (PALETTE_BASE, BENCH_BACKDROP);
+  for (int i = 1; i < 4; i++)
+    ppu_mem_write (PALETTE_BASE + 0x10 + i, BENCH_SPRITE_COLOR);
+  memset (PMEMORY.oam, 0xFF, sizeof (PMEMORY.oam));
+  ppu_mask_set (0x1E);
+}
+
+// Checks
+//
+// A sprite is drawn on the lines after its OAM Y byte, Y + 1 to
+// Y + height, and sprite 0 hit comes on the first of them.
+
+#define BENCH_SPRITE_X 100
+
+static const struct
+{
+  uint8_t y;
+  bool tall;
+} BENCH_SPRITE_CASES[] = {
+  { 0, false }, { 20, false }, { 20, true }, { 200, true }, { 238, false },
+};
+
+static bool
+bench_sprite_lines (uint8_t y, bool tall)
+{
+  int height = tall ? 2 * TILE_SIZE : TILE_SIZE;
+  int first = -1, last = -1;
+
+  bench_scene (false);
+  ppu_ctrl_set (tall ? 0x20 : 0x00);
+  PMEMORY.oam[0] = y;
+  PMEMORY.oam[1] = BENCH_SOLID_TILE;
+  PMEMORY.oam[2] = 0;
+  PMEMORY.oam[3] = BENCH_SPRITE_X;
+  bench_frame ();
+
+  for (int line = 0; line < FRAME_HEIGHT; line++)
+    if (FRAME[line][BENCH_SPRITE_X] != FRAME[line][0])
+      {
+        if (first < 0)
+          first = line;
+        last = line;
+      }
+
+  int want_last = y + height < FRAME_HEIGHT ? y + height : FRAME_HEIGHT - 1;
+  bool ok = first == y + 1 && last == want_last;
+
+  printf ("sprite 8x%-2d at Y %3u   lines %3d-%-3d  (want %d-%d)%s\n", height,
+          y, first, last, y + 1, want_last, ok ? "  ok" : "  MISMATCH");
+  return ok;
+}
+
+static bool
+bench_sprite_zero (uint8_t y)
+{
+  int hit = -1;
+
+  bench_scene (true);
+  PMEMORY.oam[0] = y;
+  PMEMORY.oam[1] = BENCH_SOLID_TILE;
+  PMEMORY.oam[2] = 0;
+  PMEMORY.oam[3] = BENCH_SPRITE_X;
+
+  size_t frame = PPU.frame_count;
+  while (PPU.frame_count == frame && hit < 0)
+    {
+      ppu_step ();
+      if (STATUS.sprite_zero)
+        hit = PPU.curr_scanline;
+    }
+
+  bool ok = hit == y + 1;
+
+  printf ("sprite 0 at Y %3u      hit on line %3d  (want %d)%s\n", y, hit,
+          y + 1, ok ? "  ok" : "  MISMATCH");
+  return ok;
+}
+
+// CHR ROM tiles are decoded once, however often their bank is switched
+// out and back in, and a window on CHR RAM takes PPUDATA writes and one
+// on CHR ROM ignores them, whichever was mapped last.
+
+#define BENCH_CHR_ROM_SIZE 0x8000
+#define BENCH_CHR_FRAMES 8
+
+static uint8_t BENCH_CHR_ROM[BENCH_CHR_ROM_SIZE];
+
+static void
+bench_chr_rom_scene (void)
+{
+  srand (2);
+  for (int i = 0; i < BENCH_CHR_ROM_SIZE; i++)
+    BENCH_CHR_ROM[i] = rand ();
+
+  bench_scene (false);
+  ppu_chr_rom (BENCH_CHR_ROM, BENCH_CHR_ROM_SIZE);
+  for (int window = 0; window < CHR_WINDOWS; window++)
+    ppu_chr_map (window, &BENCH_CHR_ROM[window * CHR_WINDOW_SIZE], window);
+  for (int i = 0; i < 2 * NMTBL_SIZE; i++)
+    ppu_mem_write (NMTBL_BASE + i, rand ());
+}
+
+static bool
+bench_chr_rom_decoded_once (void)
+{
+  uint64_t misses[BENCH_CHR_FRAMES];
+
+  bench_chr_rom_scene ();
+  for (int f = 0; f < BENCH_CHR_FRAMES; f++)
+    {
+      int bank = f % 2 ? 3 : 9;
+
+      ppu_chr_map (0, &BENCH_CHR_ROM[bank * CHR_WINDOW_SIZE], bank);
+      bench_frame ();
+      misses[f] = ppu_chr_cache_stats ().misses;
+    }
+
+  bool ok = misses[BENCH_CHR_FRAMES - 1] == misses[1];
+
+  printf ("CHR ROM bank switched  decoded %llu tiles, then %llu more%s\n",
+          (unsigned long long)misses[1],
+          (unsigned long long)(misses[BENCH_CHR_FRAMES - 1] - misses[1]),
+          ok ? "  ok" : "  MISMATCH");
+  return ok;
+}
+
+static bool
+bench_chr_sources (void)
+{
+  bench_chr_rom_scene ();
+  for (int window = 4; window < CHR_WINDOWS; window++)
+    ppu_chr_map (window, NULL, window);
+  ppu_chr_map (0, &BENCH_CHR_ROM[5 * CHR_WINDOW_SIZE], 5);
+
+  uint8_t rom = BENCH_CHR_ROM[5 * CHR_WINDOW_SIZE];
+  ppu_mem_write (0x0000, rom ^ 0xFF);
+  ppu_mem_write (PATTERN_TABLE_HI, 0xA5);
+
+  bool ok = ppu_mem_read (0x0000) == rom
+            && ppu_mem_read (PATTERN_TABLE_HI) == 0xA5
+            && BENCH_CHR_ROM[5 * CHR_WINDOW_SIZE] == rom;
+
+  printf ("CHR RAM and ROM mixed  ROM write ignored, RAM write kept%s\n",
+          ok ? "  ok" : "  MISMATCH");
+  return ok;
+}
+
+// Each nametable layout, checked by writing 1-4 to the four logical
+// nametables in turn and reading back what each then holds: a table
+// shows the last write to any table it shares memory with.
+
+static const struct
+{
+  int mode;
+  const char *name;
+  uint8_t holds[4];
+} BENCH_LAYOUTS[] = {
+  { PPU_MIRROR_HORIZONTAL, "horizontal", { 2, 2, 4, 4 } },
+  { PPU_MIRROR_VERTICAL, "vertical", { 3, 4, 3, 4 } },
+  { PPU_MIRROR_SINGLE_A, "single A", { 4, 4, 4, 4 } },
+  { PPU_MIRROR_SINGLE_B, "single B", { 4, 4, 4, 4 } },
+  { PPU_MIRROR_FOUR_SCREEN, "four-screen", { 1, 2, 3, 4 } },
+};
+
+#define BENCH_NUM_LAYOUTS (sizeof (BENCH_LAYOUTS) / sizeof (BENCH_LAYOUTS[0]))
+
+static bool
+bench_layout (int mode, const char *name, const uint8_t holds[4])
+{
+  uint8_t got[4];
+  bool ok = true;
+
+  bench_scene (false);
+  ppu_mirroring_set (mode);
+  for (int i = 0; i < 4; i++)
+    ppu_mem_write (NMTBL_BASE + i * NMTBL_SIZE, i + 1);
+  for (int i = 0; i < 4; i++)
+    {
+      got[i] = ppu_mem_read (NMTBL_BASE + i * NMTBL_SIZE);
+      ok = ok && got[i] == holds[i];
+    }
+
+  printf ("nametables %-11s  hold %u %u %u %u%s\n", name, got[0], got[1],
+          got[2], got[3], ok ? "  ok" : "  MISMATCH");
+  return ok;
+}
+
+static bool
+bench_checks (void)
+{
+  unsigned checked = 2 + BENCH_NUM_LAYOUTS, failed = 0;
+
+  failed += !bench_chr_rom_decoded_once ();
+  failed += !bench_chr_sources ();
+  for (size_t i = 0; i < BENCH_NUM_LAYOUTS; i++)
+    failed += !bench_layout (BENCH_LAYOUTS[i].mode, BENCH_LAYOUTS[i].name,
+                             BENCH_LAYOUTS[i].holds);
+
+  for (size_t i = 0;
+       i < sizeof (BENCH_SPRITE_CASES) / sizeof (BENCH_SPRITE_CASES[0]); i++)
+    {
+      checked += 2;
+      failed += !bench_sprite_lines (BENCH_SPRITE_CASES[i].y,
+                                     BENCH_SPRITE_CASES[i].tall);
+      failed += !bench_sprite_zero (BENCH_SPRITE_CASES[i].y);
+    }
+
+  printf ("%u checks, %u failed\n\n", checked, failed);
+  return failed == 0;
+}
+
+// Timing
+//
+// A busy scene: random tiles, nametables and palette, all 64 sprites
+// spread over the picture, run for BENCH_FRAMES frames drawn and as
+// many skipped.
+
+static void
+bench_busy_scene (void)
+{
+  srand (1);
+  bench_scene (false);
+  for (int i = 0; i < CHR_SIZE; i++)
+    ppu_mem_write (i, rand ());
+  for (int i = 0; i < 2 * NMTBL_SIZE; i++)
+    ppu_mem_write (NMTBL_BASE + i, rand ());
+  for (int i = 0; i < 32; i++)
+    ppu_mem_write (PALETTE_BASE + i, rand () & 0x3F);
+  for (int i = 0; i < OAM_SIZE; i++)
+    PMEMORY.oam[i] = rand ();
+}
+
+static void
+bench_timing (const char *name, bool skip)
+{
+  bench_busy_scene ();
+  ppu_render_skip (skip);
+
+  double begin = bench_now ();
+  for (int f = 0; f < BENCH_FRAMES; f++)
+    bench_frame ();
+  double elapsed = bench_now () - begin;
+
+  printf ("%-8s %6d frames %8.3f s %8.3f ms/frame\n", name, BENCH_FRAMES,
+          elapsed, elapsed * 1e3 / BENCH_FRAMES);
+}
+
+int
+main (void)
+{
+  bool conforms = bench_checks ();
+
+  bench_timing ("drawn", false);
+  bench_timing ("skipped", true);
+  return conforms ? EXIT_SUCCESS : EXIT_FAILURE;
+}